@@ -39,6 +39,29 @@
 #include <linux/pm_domain.h>
 #include <linux/proc_fs.h>
 #include <linux/version.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/dmi.h>
+#include <linux/jhash.h>
+#include <linux/async.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/sort.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/fault-inject.h>
+#include <linux/random.h>
+#include <linux/poll.h>
+#include <linux/capability.h>
+#include <linux/power_supply.h>
+#include <linux/vga_switcheroo.h>
+#include <linux/kmod.h>
+#include <linux/compat.h>
+
+#include "bbswitch.h"
 
 
 #define BBSWITCH_VERSION "0.8"
@@ -52,7 +75,17 @@ enum {
     CARD_UNCHANGED = -1,
     CARD_OFF = 0,
     CARD_ON = 1,
+    /* only reported while a transition is running */
+    CARD_TRANSITIONING = 2,
+    /* a transition did not finish within transition_timeout */
+    CARD_TIMEOUT = 3,
+    /* powered and enumerated, but in D3hot */
+    CARD_STANDBY = 4,
+    /* only reported: ON with a driver bound, when autobind is used */
+    CARD_READY = 5,
 };
+/* the states stored in bbswitch_dev.state */
+#define CARD_STATES (CARD_STANDBY + 1)
 
 static int load_state = CARD_UNCHANGED;
 MODULE_PARM_DESC(load_state, "Initial card state (0 = off, 1 = on, -1 = unchanged)");
@@ -63,9 +96,97 @@ module_param(unload_state, int, 0600);
 static bool skip_optimus_dsm = false;
 MODULE_PARM_DESC(skip_optimus_dsm, "Skip probe of Optimus discrete DSM (default = false)");
 module_param(skip_optimus_dsm, bool, 0400);
+static bool status_probe = false;
+MODULE_PARM_DESC(status_probe, "Query the firmware on every status read instead of using the cached state (default = false)");
+module_param(status_probe, bool, 0600);
+static char *backend;
+MODULE_PARM_DESC(backend, "Power control method: g14, optimus, nvidia, pr3 or sim (default = first one that works)");
+module_param(backend, charp, 0400);
+static char probe_cache[512];
+MODULE_PARM_DESC(probe_cache, "_DSM probe results of an earlier load, see README (default = empty)");
+module_param_string(probe_cache, probe_cache, sizeof(probe_cache), 0600);
+static bool async_init = true;
+MODULE_PARM_DESC(async_init, "Probe the cards and apply load_state in the background (default = true)");
+module_param(async_init, bool, 0400);
+static unsigned int transition_timeout = 5000;
+MODULE_PARM_DESC(transition_timeout, "Time in ms to wait for a power state change before reporting TIMEOUT, 0 to wait forever (default = 5000)");
+module_param(transition_timeout, uint, 0600);
+static unsigned int on_retries = 1;
+MODULE_PARM_DESC(on_retries, "Further power on attempts when the card does not come up (default = 1)");
+module_param(on_retries, uint, 0600);
+static unsigned int on_retry_delay = 250;
+MODULE_PARM_DESC(on_retry_delay, "Delay in ms before the first power on retry, doubled for each further one (default = 250)");
+module_param(on_retry_delay, uint, 0600);
+static unsigned int breaker_threshold = 3;
+MODULE_PARM_DESC(breaker_threshold, "Consecutive failed power ons after which ON requests fail immediately, 0 to disable (default = 3)");
+module_param(breaker_threshold, uint, 0600);
+static unsigned int breaker_cooldown = 60000;
+MODULE_PARM_DESC(breaker_cooldown, "Time in ms during which ON requests fail after breaker_threshold failures (default = 60000)");
+module_param(breaker_cooldown, uint, 0600);
+static unsigned int enum_timeout = 2500;
+MODULE_PARM_DESC(enum_timeout, "Time in ms to wait for the card to appear on the bus after powering it on (default = 2500)");
+module_param(enum_timeout, uint, 0600);
+static unsigned int on_latency_us;
+MODULE_PARM_DESC(on_latency_us, "Average time in us for the card to appear after powering it on, learned at runtime (default = 0, unknown)");
+module_param(on_latency_us, uint, 0644);
+static unsigned int journal_size = 256;
+MODULE_PARM_DESC(journal_size, "Number of transitions and AML evaluations kept in the debugfs journal, 0 to disable (default = 256)");
+module_param(journal_size, uint, 0400);
+static unsigned int sim_cards = 1;
+MODULE_PARM_DESC(sim_cards, "Number of simulated cards created with backend=sim (default = 1)");
+module_param(sim_cards, uint, 0400);
+static unsigned int sim_on_ms = 300;
+MODULE_PARM_DESC(sim_on_ms, "Duration in ms of the simulated _ON (default = 300)");
+module_param(sim_on_ms, uint, 0600);
+static unsigned int sim_off_ms = 100;
+MODULE_PARM_DESC(sim_off_ms, "Duration in ms of the simulated _OFF (default = 100)");
+module_param(sim_off_ms, uint, 0600);
+static unsigned int sim_enum_ms = 200;
+MODULE_PARM_DESC(sim_enum_ms, "Time in ms for a simulated card to appear on the bus after _ON (default = 200)");
+module_param(sim_enum_ms, uint, 0600);
+static unsigned int sim_fail_rate;
+MODULE_PARM_DESC(sim_fail_rate, "Percentage of simulated _ON and _OFF calls that fail (default = 0)");
+module_param(sim_fail_rate, uint, 0600);
+static unsigned int aspm = 1;
+MODULE_PARM_DESC(aspm, "ASPM enabled on the link to the card after power on: 0 = leave as is, 1 = L1, 2 = L1 and L1 substates (default = 1, needs Linux 6.3)");
+module_param(aspm, uint, 0600);
+static bool link_quiesce = true;
+MODULE_PARM_DESC(link_quiesce, "Put the card in D3hot before turning off a power resource that removes it from the bus (default = true)");
+module_param(link_quiesce, bool, 0600);
+static int ac_state = CARD_UNCHANGED;
+MODULE_PARM_DESC(ac_state, "Card state when the machine gets plugged in: -1 = unchanged, 0 = OFF, 1 = ON (default = -1)");
+module_param(ac_state, int, 0600);
+static int battery_state = CARD_UNCHANGED;
+MODULE_PARM_DESC(battery_state, "Card state when the machine runs on battery: -1 = unchanged, 0 = OFF, 1 = ON (default = -1)");
+module_param(battery_state, int, 0600);
+static unsigned int battery_delay;
+MODULE_PARM_DESC(battery_delay, "Seconds on battery before battery_state is applied (default = 0)");
+module_param(battery_delay, uint, 0600);
+static unsigned int autosuspend_delay = 10000;
+MODULE_PARM_DESC(autosuspend_delay, "Time in ms the autosuspend-timer governor keeps an unused card on (default = 10000)");
+module_param(autosuspend_delay, uint, 0600);
+static unsigned int predictive_breakeven = 30000;
+MODULE_PARM_DESC(predictive_breakeven, "Expected unused time in ms below which the predictive governor uses STANDBY instead of OFF (default = 30000)");
+module_param(predictive_breakeven, uint, 0600);
+static unsigned int reconcile_interval;
+static bool reconcile_repair;
+MODULE_PARM_DESC(reconcile_repair, "Turn cards that should be off off again, rescan the bus for missing ones and correct the reported state (default = false)");
+module_param(reconcile_repair, bool, 0600);
+static bool switcheroo;
+MODULE_PARM_DESC(switcheroo, "Let the DRM driver power the card of the g14 backend on and off through vga_switcheroo (default = false)");
+module_param(switcheroo, bool, 0400);
+static char autobind[32];
+// guards autobind instead of the parameter lock, which bind_work cannot take:
+// bbswitch_exit() waits for it with governor_lock held
+static DEFINE_SPINLOCK(autobind_lock);
+static bool autobind_enabled;       /* autobind is not empty */
 
 extern struct proc_dir_entry *acpi_root_dir;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+#define pde_data PDE_DATA
+#endif
+
 static const char acpi_optimus_dsm_muid[16] = {
     0xF8, 0xD8, 0x86, 0xA4, 0xDA, 0x0B, 0x1B, 0x47,
     0xA7, 0x2B, 0x60, 0x42, 0xA6, 0xB5, 0xBE, 0xE0,
@@ -86,22 +207,413 @@ It looks like something for Intel GPU:
 http://lxr.linux.no/#linux+v3.1.5/drivers/gpu/drm/i915/intel_acpi.c
  */
 
-#define DSM_TYPE_UNSUPPORTED    0
-#define DSM_TYPE_OPTIMUS        1
-#define DSM_TYPE_NVIDIA         2
-static int dsm_type = DSM_TYPE_UNSUPPORTED;
+struct bbswitch_dev;
+
+/* power control method of a card, selected once at load time */
+struct bbswitch_backend {
+    const char *name;
+    // returns 0 if the backend can switch this card
+    int (*probe)(struct bbswitch_dev *bd, acpi_handle igd_handle);
+    // return 0 on success and non-zero otherwise
+    int (*on)(struct bbswitch_dev *bd);
+    int (*off)(struct bbswitch_dev *bd);
+    // 1 if disabled, 0 if enabled, -1 if powered but not on the bus yet,
+    // -EIO if the firmware could not be queried
+    int (*is_disabled)(struct bbswitch_dev *bd);
+    // optional, whether a powered card is on the bus. Defaults to looking
+    // the PCI device up.
+    bool (*enumerated)(struct bbswitch_dev *bd);
+    // whether the card disappears from the bus while it is off
+    bool removes_device;
+    // only used when selected with the backend parameter
+    bool explicit_only;
+};
+
+/* sizes of the counters of the metrics file */
+#define BBSWITCH_CAUSES (BBSWITCH_CAUSE_SWITCHEROO + 1)
+#define BBSWITCH_COMMANDS (BBSWITCH_JOURNAL_STANDBY + 1)
+#define BBSWITCH_STAGES (BBSWITCH_STAGE_ERROR + 1)
+enum {
+    REFUSAL_IN_USE,     /* a driver or a hold keeps the card on */
+    REFUSAL_BREAKER,    /* the circuit breaker is open */
+    METRICS_REFUSALS,
+};
 
-static struct pci_dev *dis_dev;
-static acpi_handle dis_handle;
+/* per discrete card state, one for each adapter found at load time */
+struct bbswitch_dev {
+    /* hot: used by every transition and status read */
+    struct mutex lock;          /* serialises power state changes */
+    struct mutex power_lock;    /* serialises the backend calls, nests in lock */
+    struct pci_dev *pdev;       /* NULL while the card is off the bus */
+    int state;                  /* last known CARD_* state, see bbswitch_cache_state() */
+    unsigned int hold_count;    /* file descriptors on the device node holding the card on */
+    int hold_restore;           /* CARD_* state before the first hold */
+    const struct bbswitch_backend *backend;
+    acpi_handle handle;         /* ACPI handle of the card (PEGP) */
+    acpi_handle power_handle;   /* power resource (PG00) of the g14 backend */
+
+    /* cold: set up once at probe time */
+    struct list_head list;
+    int index;
+    int domain;
+    unsigned int bus;
+    unsigned int devfn;
+    char name[16];
+    acpi_handle dsm_handle;
+    /* CARD_* state to restore after resume */
+    int before_suspend_state;
+    char node_name[16];
+    struct proc_dir_entry *proc_entry;
+    struct miscdevice misc;
+    struct dentry *debugfs;
+
+    bool standby;               /* in D3hot for CARD_STANDBY, protected by lock,
+                                   but cleared when a driver binds */
+    bool ready;                 /* a driver is bound, see CARD_READY */
+    bool overridden;            /* driver_override set by bind_work */
+    struct work_struct bind_work;
+    struct work_struct switcheroo_work; /* bookkeeping after a switcheroo call */
+
+    /* simulated card of the sim backend, protected by lock */
+    bool sim_powered;
+    ktime_t sim_ready;          /* when it appears on the bus after _ON */
+
+    /* requests for the transition worker, protected by req_lock */
+    spinlock_t req_lock;
+    int target;
+    u64 request_seq;
+    u64 done_seq;
+    int result;             /* of the transition that finished done_seq */
+    int req_cause;          /* BBSWITCH_CAUSE_* of the last request */
+    unsigned int req_flags; /* BBSWITCH_SET_FORCE_UNBIND */
+    pid_t req_pid;
+    char req_comm[TASK_COMM_LEN];
+    int stage;              /* BBSWITCH_STAGE_* */
+    ktime_t stage_since;
+    ktime_t stage_time[BBSWITCH_STAGES];    /* reached in this transition */
+    u64 stage_ns[BBSWITCH_STAGES];          /* total time in each stage */
+    unsigned int on_failures;
+    bool breaker_open;
+    unsigned long breaker_until;
+    struct work_struct transition_work;
+    struct delayed_work gov_work;       /* timer of the governor */
+    ktime_t gov_idle_since;             /* predictive: unused since */
+    u32 gov_idle_ms;                    /* predictive: average unused time */
+    unsigned long gov_deferred;         /* GOV_DEFER_* bits */
+    wait_queue_head_t transition_wq;    /* also woken on state changes */
+    atomic_t state_changes;
+    atomic_t stuck_transitions;
+    atomic_t mismatches;        /* found by the reconciler */
+
+    /* counters of the metrics file, protected by metrics_lock */
+    u64 transitions[BBSWITCH_CAUSES][BBSWITCH_COMMANDS];
+    u64 refusals[METRICS_REFUSALS][BBSWITCH_COMMANDS];
+    u64 failures[BBSWITCH_COMMANDS];
+    u64 state_ns[CARD_STATES];
+    ktime_t state_since;        /* of the current state */
+    u64 status_reads[2];        /* from the cache, from the hardware */
+};
 
-static char dis_dev_name[16];
-unsigned int vendor;
-unsigned int device;
+static LIST_HEAD(bbswitch_devices);
 
 static struct dev_pm_domain pm_domain;
 
-/* whether the card was off before suspend or not; on: 0, off: 1 */
-static int dis_before_suspend_disabled;
+/* probing state shared with the asynchronous part of bbswitch_init() */
+static ASYNC_DOMAIN_EXCLUSIVE(bbswitch_async_domain);
+static DECLARE_COMPLETION(bbswitch_setup_done);
+// set once bbswitch_exit() runs, asynchronous events are ignored from then on
+static bool bbswitch_exiting;
+static acpi_handle igd_handle;
+static bool cache_hit;
+static u32 probe_key;
+
+static struct dentry *bbswitch_debugfs;
+/* runs the transitions so that hung AML cannot block the requesters */
+static struct workqueue_struct *bbswitch_wq;
+
+/* time spent in each phase of loading, see init_timings in debugfs */
+enum {
+    INIT_PCI_SCAN,
+    INIT_DSM_PROBE,     /* also counted in the phase that needed the probe */
+    INIT_REGISTER,
+    INIT_PCI_ENABLE,
+    INIT_LOAD_STATE,
+    INIT_PM_NOTIFIER,
+    INIT_TOTAL,
+    INIT_PHASES,
+};
+static const char * const init_phase_names[INIT_PHASES] = {
+    [INIT_PCI_SCAN]     = "pci_scan",
+    [INIT_DSM_PROBE]    = "dsm_probe",
+    [INIT_REGISTER]     = "register",
+    [INIT_PCI_ENABLE]   = "pci_enable",
+    [INIT_LOAD_STATE]   = "load_state",
+    [INIT_PM_NOTIFIER]  = "pm_notifier",
+    [INIT_TOTAL]        = "total",
+};
+static s64 init_phase_us[INIT_PHASES];
+static ktime_t init_start;
+
+static void init_phase_end(int phase, ktime_t start) {
+    init_phase_us[phase] += ktime_us_delta(ktime_get(), start);
+}
+
+struct bbswitch_file {
+    struct bbswitch_dev *bd;
+    bool held;
+    int seen_changes;           /* state changes reported to this reader */
+};
+
+/*
+ * Counters and histograms rendered by the metrics file in debugfs in the
+ * OpenMetrics text format. They are only updated on transitions, status
+ * reads and AML evaluations, all rare enough for a single lock.
+ */
+static DEFINE_SPINLOCK(metrics_lock);
+
+static const char * const metrics_states[CARD_STATES] = {
+    [CARD_OFF]              = "off",
+    [CARD_ON]               = "on",
+    [CARD_TRANSITIONING]    = "transitioning",
+    [CARD_TIMEOUT]          = "timeout",
+    [CARD_STANDBY]          = "standby",
+};
+
+/* the journal commands of the transitions, AML is counted separately */
+static const char * const metrics_commands[BBSWITCH_COMMANDS] = {
+    [BBSWITCH_JOURNAL_OFF]      = "off",
+    [BBSWITCH_JOURNAL_ON]       = "on",
+    [BBSWITCH_JOURNAL_STANDBY]  = "standby",
+};
+
+static const char * const metrics_refusals[METRICS_REFUSALS] = {
+    [REFUSAL_IN_USE]    = "in_use",
+    [REFUSAL_BREAKER]   = "breaker",
+};
+
+/* latency of the AML methods, the last row counts any other method */
+static const char * const aml_methods[] = { "_DSM", "_ON", "_OFF", "SGST" };
+static const struct {
+    u32 us;
+    const char *le;
+} aml_buckets[] = {
+    { 100, "0.0001" },
+    { 1000, "0.001" },
+    { 10000, "0.01" },
+    { 100000, "0.1" },
+    { 1000000, "1.0" },
+    { 10000000, "10.0" },
+};
+struct aml_latency {
+    u64 count[ARRAY_SIZE(aml_buckets) + 1];     /* not cumulative */
+    u64 sum_us;
+};
+static struct aml_latency aml_latency[ARRAY_SIZE(aml_methods) + 1];
+
+static void metrics_aml(const char *method, u32 us) {
+    unsigned int m, b;
+
+    for (m = 0; m < ARRAY_SIZE(aml_methods); m++) {
+        if (!strcmp(method, aml_methods[m]))
+            break;
+    }
+    for (b = 0; b < ARRAY_SIZE(aml_buckets); b++) {
+        if (us <= aml_buckets[b].us)
+            break;
+    }
+
+    spin_lock(&metrics_lock);
+    aml_latency[m].count[b]++;
+    aml_latency[m].sum_us += us;
+    spin_unlock(&metrics_lock);
+}
+
+// Accounts the time spent in the state that is being left
+static void metrics_state(struct bbswitch_dev *bd, int old, int state) {
+    ktime_t now = ktime_get();
+
+    spin_lock(&metrics_lock);
+    if (old >= 0)
+        bd->state_ns[old] += ktime_to_ns(ktime_sub(now, bd->state_since));
+    bd->state_since = now;
+    spin_unlock(&metrics_lock);
+}
+
+static void metrics_transition(struct bbswitch_dev *bd, int cause,
+    int command, int result) {
+    spin_lock(&metrics_lock);
+    bd->transitions[cause][command]++;
+    if (result == -EBUSY)
+        bd->refusals[REFUSAL_IN_USE][command]++;
+    else if (result)
+        bd->failures[command]++;
+    spin_unlock(&metrics_lock);
+}
+
+static void metrics_refusal(struct bbswitch_dev *bd, int reason, int command) {
+    spin_lock(&metrics_lock);
+    bd->refusals[reason][command]++;
+    spin_unlock(&metrics_lock);
+}
+
+static void metrics_status_read(struct bbswitch_dev *bd, bool hardware) {
+    spin_lock(&metrics_lock);
+    bd->status_reads[hardware]++;
+    spin_unlock(&metrics_lock);
+}
+
+/*
+ * Journal of the last journal_size transitions and AML evaluations. Writers
+ * reserve a slot with an atomic counter and publish it by writing its
+ * sequence number last, readers drop slots that changed while copying them.
+ */
+static struct bbswitch_journal_entry *journal;
+static unsigned int journal_mask;
+static atomic64_t journal_head = ATOMIC64_INIT(0);
+
+static const char * const journal_causes[] = {
+    [BBSWITCH_CAUSE_USER]   = "user",
+    [BBSWITCH_CAUSE_HOLD]   = "hold",
+    [BBSWITCH_CAUSE_PM]     = "pm",
+    [BBSWITCH_CAUSE_INIT]   = "init",
+    [BBSWITCH_CAUSE_EXIT]   = "exit",
+    [BBSWITCH_CAUSE_AML]    = "aml",
+    [BBSWITCH_CAUSE_POLICY] = "policy",
+    [BBSWITCH_CAUSE_GOVERNOR] = "governor",
+    [BBSWITCH_CAUSE_RECONCILE] = "reconcile",
+    [BBSWITCH_CAUSE_SWITCHEROO] = "switcheroo",
+};
+
+// Only once nothing can add entries or read them through debugfs anymore
+static void journal_free(void) {
+    kvfree(journal);
+    journal = NULL;
+}
+
+static void journal_add(const char *device, int cause, pid_t pid,
+    const char *comm, int command, const char *method, int status,
+    ktime_t start, int state) {
+    struct bbswitch_journal_entry *e;
+    u64 seq;
+
+    if (!journal)
+        return;
+
+    seq = atomic64_inc_return(&journal_head);
+    e = &journal[(seq - 1) & journal_mask];
+    WRITE_ONCE(e->seq, 0);
+    smp_wmb();
+    e->timestamp_ns = ktime_to_ns(start) + ktime_get_boottime_ns() -
+        ktime_get_ns();
+    e->duration_us = ktime_us_delta(ktime_get(), start);
+    e->status = status;
+    e->pid = pid;
+    e->cause = cause;
+    e->command = command;
+    e->state = state;
+    strscpy(e->comm, comm ? comm : "", sizeof(e->comm));
+    strscpy(e->method, method, sizeof(e->method));
+    strscpy(e->device, device ? device : "", sizeof(e->device));
+    smp_store_release(&e->seq, seq);
+}
+
+// AML evaluations are attributed to the task running them
+static void journal_aml(const char *device, const char *method, int status,
+    ktime_t start, int state) {
+    metrics_aml(method, ktime_us_delta(ktime_get(), start));
+    journal_add(device, BBSWITCH_CAUSE_AML, task_pid_nr(current),
+        current->comm, BBSWITCH_JOURNAL_AML, method, status, start, state);
+}
+
+// Copies the consistent entries, oldest first. Returns their number.
+static unsigned int journal_snapshot(struct bbswitch_journal_entry *out) {
+    u64 head = atomic64_read(&journal_head);
+    u64 seq = head > journal_mask ? head - journal_mask : 1;
+    unsigned int n = 0;
+
+    for (; seq <= head; seq++) {
+        struct bbswitch_journal_entry *e = &journal[(seq - 1) & journal_mask];
+
+        if (smp_load_acquire(&e->seq) != seq)
+            continue;
+        out[n] = *e;
+        smp_rmb();
+        if (READ_ONCE(e->seq) == seq)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * Fault injection points, configured below /sys/kernel/debug/bbswitch/ like
+ * any other fault_attr. When a point triggers it first sleeps delay_ms and
+ * then fails the operation, unless fail has been cleared to only inject the
+ * delay.
+ */
+struct bbswitch_fault {
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+    struct fault_attr attr;
+    u32 delay_ms;
+    bool fail;
+#endif
+    const char *name;
+};
+
+enum {
+    FAULT_DSM,
+    FAULT_POWER,
+    FAULT_SGST,
+    FAULT_LOOKUP,
+    FAULT_COUNT,
+};
+
+static struct bbswitch_fault bbswitch_faults[FAULT_COUNT] = {
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+#define BBSWITCH_FAULT(n) { .attr = FAULT_ATTR_INITIALIZER, .fail = true, .name = n }
+#else
+#define BBSWITCH_FAULT(n) { .name = n }
+#endif
+    [FAULT_DSM]     = BBSWITCH_FAULT("fail_dsm"),
+    [FAULT_POWER]   = BBSWITCH_FAULT("fail_power"),
+    [FAULT_SGST]    = BBSWITCH_FAULT("fail_sgst"),
+    [FAULT_LOOKUP]  = BBSWITCH_FAULT("fail_lookup"),
+#undef BBSWITCH_FAULT
+};
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+// Returns true if the operation must fail
+static bool bbswitch_should_fail(int point) {
+    struct bbswitch_fault *f = &bbswitch_faults[point];
+
+    if (!should_fail(&f->attr, 1))
+        return false;
+
+    if (f->delay_ms)
+        msleep(f->delay_ms);
+    return f->fail;
+}
+
+static void bbswitch_faults_init(struct dentry *parent) {
+    struct dentry *dir;
+    int i;
+
+    for (i = 0; i < FAULT_COUNT; i++) {
+        dir = fault_create_debugfs_attr(bbswitch_faults[i].name, parent,
+            &bbswitch_faults[i].attr);
+        if (IS_ERR(dir))
+            continue;
+        debugfs_create_u32("delay_ms", 0600, dir, &bbswitch_faults[i].delay_ms);
+        debugfs_create_bool("fail", 0600, dir, &bbswitch_faults[i].fail);
+    }
+}
+#else
+static inline bool bbswitch_should_fail(int point) {
+    return false;
+}
+
+static inline void bbswitch_faults_init(struct dentry *parent) {
+}
+#endif
 
 static char *buffer_to_string(const char *buffer, size_t n, char *target) {
     int i;
@@ -120,6 +632,7 @@ static int acpi_call_dsm(acpi_handle handle, const char muid[16], int revid,
     struct acpi_object_list input;
     union acpi_object params[4];
     union acpi_object *obj;
+    ktime_t start;
     int err;
 
     input.count = 4;
@@ -144,7 +657,12 @@ static int acpi_call_dsm(acpi_handle handle, const char muid[16], int revid,
         params[3].buffer.pointer = (char[4]){0, 0, 0, 0};
     }
 
-    err = acpi_evaluate_object(handle, "_DSM", &input, &output);
+    start = ktime_get();
+    if (bbswitch_should_fail(FAULT_DSM))
+        err = AE_ERROR;
+    else
+        err = acpi_evaluate_object(handle, "_DSM", &input, &output);
+    journal_aml(NULL, "_DSM", err, start, -1);
     if (err) {
         struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
         char muid_str[5 * 16];
@@ -180,248 +698,2267 @@ static int acpi_call_dsm(acpi_handle handle, const char muid[16], int revid,
     return 0;
 }
 
-// Returns 1 if a _DSM function and its function index exists and 0 otherwise
-static int has_dsm_func(const char muid[16], int revid, int sfnc) {
+/* _DSM function 0 results, each UUID is only queried once per handle */
+#define DSM_MASK_CACHE_SIZE 8
+struct dsm_mask_entry {
+    acpi_handle handle;
+    const char *muid;
+    int revid;
+    u32 mask;
+    s64 probe_us;       /* time spent evaluating it, -1 if from probe_cache */
+};
+static struct dsm_mask_entry dsm_masks[DSM_MASK_CACHE_SIZE];
+static int dsm_mask_count;
+
+static struct dsm_mask_entry *dsm_mask_store(acpi_handle handle,
+    const char muid[16], int revid, u32 mask) {
+    struct dsm_mask_entry *e;
+
+    if (dsm_mask_count >= DSM_MASK_CACHE_SIZE)
+        return NULL;
+    e = &dsm_masks[dsm_mask_count++];
+    e->handle = handle;
+    e->muid = muid;
+    e->revid = revid;
+    e->mask = mask;
+    e->probe_us = -1;
+    return e;
+}
+
+// Returns the supported functions bitmask of _DSM function 0
+static u32 dsm_func_mask(acpi_handle handle, const char muid[16], int revid) {
+    struct dsm_mask_entry *e;
+    ktime_t start;
     u32 result = 0;
+    s64 us;
+    int i;
 
-    // fail if the _DSM call failed
-    if (acpi_call_dsm(dis_handle, muid, revid, 0, 0, &result))
-        return 0;
+    for (i = 0; i < dsm_mask_count; i++) {
+        if (dsm_masks[i].handle == handle && dsm_masks[i].muid == muid &&
+            dsm_masks[i].revid == revid)
+            return dsm_masks[i].mask;
+    }
 
-    // ACPI Spec v4 9.14.1: if bit 0 is zero, no function is supported. If
-    // the n-th bit is enabled, function n is supported
-    return result & 1 && result & (1 << sfnc);
+    start = ktime_get();
+    // a failed call means that no function is supported
+    if (acpi_call_dsm(handle, muid, revid, 0, 0, &result))
+        result = 0;
+    us = ktime_us_delta(ktime_get(), start);
+    init_phase_us[INIT_DSM_PROBE] += us;
+
+    e = dsm_mask_store(handle, muid, revid, result);
+    if (e)
+        e->probe_us = us;
+    return result;
 }
 
+// Returns 1 if a _DSM function and its function index exists and 0 otherwise
 static int handle_has_dsm_func(acpi_handle handle, const char muid[16], int revid, int sfnc) {
-    u32 result = 0;
-
-    // fail if the _DSM call failed
-    if (acpi_call_dsm(handle, muid, revid, 0, 0, &result))
-        return 0;
+    u32 result = dsm_func_mask(handle, muid, revid);
 
     // ACPI Spec v4 9.14.1: if bit 0 is zero, no function is supported. If
     // the n-th bit is enabled, function n is supported
     return result & 1 && result & (1 << sfnc);
 }
 
-static int bbswitch_optimus_dsm(void) {
-    if (dsm_type == DSM_TYPE_OPTIMUS) {
-        char args[] = {1, 0, 0, 3};
-        u32 result = 0;
+/*
+ * The function 0 results are persisted across loads through the probe_cache
+ * parameter as "KEY;PATH,TYPE,MASK;..." where KEY identifies the machine and
+ * its ACPI tables, PATH is the ACPI path without the leading backslash, TYPE
+ * is 'o' (Optimus) or 'n' (nVidia) and MASK the hexadecimal bitmask.
+ */
+static u32 bbswitch_probe_key(void) {
+    static const int dmi_fields[] = {
+        DMI_SYS_VENDOR, DMI_PRODUCT_NAME, DMI_BIOS_VERSION, DMI_BIOS_DATE,
+    };
+    struct acpi_table_header *table;
+    const char *s;
+    u32 key = 0;
+    int i;
 
-        if (acpi_call_dsm(dis_handle, acpi_optimus_dsm_muid, 0x100, 0x1A, args,
-            &result)) {
-            // failure
-            return 1;
-        }
-        pr_debug("Result of Optimus _DSM call: %08X\n", result);
+    for (i = 0; i < ARRAY_SIZE(dmi_fields); i++) {
+        s = dmi_get_system_info(dmi_fields[i]);
+        if (s)
+            key = jhash(s, strlen(s), key);
     }
-    return 0;
+
+    if (ACPI_SUCCESS(acpi_get_table(ACPI_SIG_DSDT, 0, &table))) {
+        key = jhash_2words(table->checksum, table->oem_revision, key);
+        acpi_put_table(table);
+    }
+    for (i = 1; ACPI_SUCCESS(acpi_get_table(ACPI_SIG_SSDT, i, &table)); i++) {
+        key = jhash_2words(table->checksum, table->oem_revision, key);
+        acpi_put_table(table);
+    }
+    return key;
 }
 
-static void get_dis_dev(void){
-    struct pci_dev *pdev = NULL;
+// Preloads the _DSM masks from probe_cache, returns true if it matched
+static bool bbswitch_load_probe_cache(u32 key) {
+    char *str, *cur, *entry, *path, *type, *mask;
+    char fullpath[64];
+    acpi_handle handle;
+    u32 cached_key, value;
+    bool hit = false;
+
+    if (!probe_cache[0])
+        return false;
+
+    str = kstrdup(probe_cache, GFP_KERNEL);
+    if (!str)
+        return false;
+
+    cur = str;
+    entry = strsep(&cur, ";");
+    if (kstrtou32(entry, 16, &cached_key) || cached_key != key) {
+        pr_info("probe cache is stale, probing again\n");
+        goto out;
+    }
+
+    while ((entry = strsep(&cur, ";")) != NULL) {
+        path = strsep(&entry, ",");
+        type = strsep(&entry, ",");
+        mask = entry;
+        if (!type || !mask || kstrtou32(mask, 16, &value))
+            continue;
+
+        snprintf(fullpath, sizeof(fullpath), "\\%s", path);
+        if (ACPI_FAILURE(acpi_get_handle(NULL, fullpath, &handle)))
+            continue;
 
-    if ((pdev = pci_get_device(vendor, device, pdev)) != NULL) {
-        dis_dev = pdev;
+        if (type[0] == 'o')
+            dsm_mask_store(handle, acpi_optimus_dsm_muid, 0x100, value);
+        else if (type[0] == 'n')
+            dsm_mask_store(handle, acpi_nvidia_dsm_muid, 0x102, value);
     }
+    hit = true;
+out:
+    kfree(str);
+    return hit;
 }
 
-static int bbswitch_acpi_off(void) {
-	struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
+// Writes the _DSM masks found during this load to probe_cache
+static void bbswitch_save_probe_cache(u32 key) {
+    size_t len;
+    int i;
 
-    acpi_status err = (acpi_status) 0x0;
-    acpi_handle hnd;
-    err = acpi_get_handle(NULL, (acpi_string) "\\_SB.PCI0.GPP0.PG00", &hnd);
-    err = acpi_evaluate_object(hnd,"_OFF", NULL, &buffer);
-    kfree(buffer.pointer);
+    len = scnprintf(probe_cache, sizeof(probe_cache), "%08x", key);
+    for (i = 0; i < dsm_mask_count; i++) {
+        struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+        const char *path;
+
+        if (ACPI_FAILURE(acpi_get_name(dsm_masks[i].handle, ACPI_FULL_PATHNAME,
+            &buf)))
+            continue;
+
+        path = buf.pointer;
+        if (path[0] == '\\')
+            path++;
+        len += scnprintf(probe_cache + len, sizeof(probe_cache) - len,
+            ";%s,%c,%x", path,
+            dsm_masks[i].muid == acpi_optimus_dsm_muid ? 'o' : 'n',
+            dsm_masks[i].mask);
+        kfree(buf.pointer);
+    }
+}
+
+static int bbswitch_optimus_dsm(struct bbswitch_dev *bd) {
+    char args[] = {1, 0, 0, 3};
+    u32 result = 0;
+
+    if (acpi_call_dsm(bd->dsm_handle, acpi_optimus_dsm_muid, 0x100, 0x1A,
+        args, &result)) {
+        // failure
+        return 1;
+    }
+    pr_debug("Result of Optimus _DSM call: %08X\n", result);
     return 0;
 }
 
-static int bbswitch_acpi_on(void) {
-	struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
+// state is 1 for ON and 2 for OFF
+static int bbswitch_nvidia_dsm(struct bbswitch_dev *bd, char state) {
+    char args[] = {state, 0, 0, 0};
+    u32 result = 0;
 
-    acpi_status err = (acpi_status) 0x0000;
-    acpi_handle hnd;
-    err = acpi_get_handle(NULL, (acpi_string) "\\_SB.PCI0.GPP0.PG00", &hnd);
-    err = acpi_evaluate_object(hnd,"_ON", NULL, &buffer);
-    kfree(buffer.pointer);
+    if (acpi_call_dsm(bd->dsm_handle, acpi_nvidia_dsm_muid, 0x102, 0x3, args,
+        &result)) {
+        // failure
+        return 1;
+    }
+    pr_debug("Result of _DSM call for %s: %08X\n", state == 1 ? "ON" : "OFF",
+        result);
+    return 0;
+}
+
+// Looks the card up on the bus again, it disappears while powered off
+static void get_dis_dev(struct bbswitch_dev *bd) {
+    struct pci_dev *pdev;
+
+    if (bd->pdev)
+        return;
+
+    // an injected failure looks like a card that has not appeared yet
+    if (bbswitch_should_fail(FAULT_LOOKUP))
+        return;
+
+    pdev = pci_get_domain_bus_and_slot(bd->domain, bd->bus, bd->devfn);
+    if (pdev != NULL)
+        bd->pdev = pdev;
+}
+
+static void put_dis_dev(struct bbswitch_dev *bd) {
+    pci_dev_put(bd->pdev);
+    bd->pdev = NULL;
+}
+
+// Returns true once a powered card can be accessed on the bus
+static bool bbswitch_enumerated(struct bbswitch_dev *bd) {
+    if (bd->backend->enumerated)
+        return bd->backend->enumerated(bd);
+    get_dis_dev(bd);
+    return bd->pdev != NULL;
+}
+
+/*
+ * G14 power resource backend: PG00 _ON/_OFF next to the card below the root
+ * port. The card drops off the bus while off, SGST on the card tells whether
+ * the firmware has it powered.
+ */
+static int bbswitch_g14_probe(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    acpi_handle parent;
+
+    if (!acpi_has_method(bd->handle, "SGST"))
+        return -ENODEV;
+
+    if (ACPI_FAILURE(acpi_get_parent(bd->handle, &parent)) ||
+        ACPI_FAILURE(acpi_get_handle(parent, "PG00", &bd->power_handle)))
+        return -ENODEV;
 
     return 0;
 }
 
-// Returns 1 if the card is disabled, 0 if enabled
+static int bbswitch_g14_off(struct bbswitch_dev *bd) {
+    struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
+    ktime_t start = ktime_get();
+    acpi_status err;
+
+    if (bbswitch_should_fail(FAULT_POWER))
+        err = AE_ERROR;
+    else
+        err = acpi_evaluate_object(bd->power_handle, "_OFF", NULL, &buffer);
+    journal_aml(bd->name, "_OFF", err, start, -1);
+    kfree(buffer.pointer);
+    if (ACPI_FAILURE(err)) {
+        pr_warn("%s: _OFF failed: %s\n", bd->name, acpi_format_exception(err));
+        return 1;
+    }
+    return 0;
+}
 
-// NOTE: With a fully disabling PCI device(disappears from 'lspci'), 
-// you must check that this is '0' anytime you're wanting to interact with dis_dev.
-// Otherwise, you will segfault.
-static int is_card_disabled(void) {
+static int bbswitch_g14_on(struct bbswitch_dev *bd) {
     struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
+    ktime_t start = ktime_get();
+    acpi_status err;
+
+    if (bbswitch_should_fail(FAULT_POWER))
+        err = AE_ERROR;
+    else
+        err = acpi_evaluate_object(bd->power_handle, "_ON", NULL, &buffer);
+    journal_aml(bd->name, "_ON", err, start, -1);
+    kfree(buffer.pointer);
+    if (ACPI_FAILURE(err)) {
+        pr_warn("%s: _ON failed: %s\n", bd->name, acpi_format_exception(err));
+        return 1;
+    }
+    return 0;
+}
 
-    acpi_status err = (acpi_status) 0x0000;
-    acpi_handle hnd;
+// Returns 1 if the card is disabled, 0 if enabled, -1 if it is powered but
+// not on the bus yet and -EIO if SGST failed
 
-    acpi_get_handle(NULL, (acpi_string) "\\_SB.PCI0.GPP0.PEGP", &hnd);
-    err = acpi_evaluate_object(hnd,"SGST", NULL, &buffer);
-    int gpustatus = ((union acpi_object *)buffer.pointer)->integer.value > 0 ? 0 : 1;
+// NOTE: With a fully disabling PCI device(disappears from 'lspci'), 
+// you must check that this is '0' anytime you're wanting to interact with bd->pdev.
+// Otherwise, you will segfault.
+static int bbswitch_g14_is_disabled(struct bbswitch_dev *bd) {
+    unsigned long long sgst = 0;
+    ktime_t start = ktime_get();
+    acpi_status err;
+    int gpustatus;
+
+    if (bbswitch_should_fail(FAULT_SGST))
+        err = AE_ERROR;
+    else
+        err = acpi_evaluate_integer(bd->handle, "SGST", NULL, &sgst);
+    if (ACPI_FAILURE(err)) {
+        journal_aml(bd->name, "SGST", err, start, -1);
+        pr_warn("%s: SGST failed: %s\n", bd->name, acpi_format_exception(err));
+        // unknown, not off: an OFF would be skipped as already done
+        return -EIO;
+    }
+    journal_aml(bd->name, "SGST", err, start, sgst > 0 ? CARD_ON : CARD_OFF);
+    gpustatus = sgst > 0 ? 0 : 1;
     if(gpustatus == 0){
-        get_dis_dev();
-        if(dis_dev == NULL){
+        get_dis_dev(bd);
+        if(bd->pdev == NULL){
             // Card is still powering on.
             gpustatus = -1;
         }
     }
 
-    kfree(buffer.pointer);
-
     return gpustatus;
 }
 
-static void bbswitch_off(void) {
-    if (is_card_disabled() == 1){
-        pr_info("discrete graphics already disabled");
-        return;
-    }
-    
-    if (dis_dev->driver) {
-        pr_warn("device %s is in use by driver '%s', refusing OFF\n",
-            dis_dev_name, dis_dev->driver->name);
-        return;
+/*
+ * The remaining backends keep the card on the bus and put it in D3cold. The
+ * ACPI core evaluates _PS3 or turns off the _PR3 power resources for us.
+ */
+static void bbswitch_pci_off(struct bbswitch_dev *bd) {
+    struct acpi_device *ad;
+
+    pci_save_state(bd->pdev);
+    pci_clear_master(bd->pdev);
+    pci_disable_device(bd->pdev);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    ad = acpi_fetch_acpi_dev(bd->handle);
+#else
+    if (acpi_bus_get_device(bd->handle, &ad))
+        ad = NULL;
+#endif
+    if (!ad) {
+        pr_warn("Cannot get ACPI device for PCI device\n");
+    } else if (ad->power.state == ACPI_STATE_UNKNOWN) {
+        pr_debug("ACPI power state is unknown, forcing D0\n");
+        ad->power.state = ACPI_STATE_D0;
     }
-    
-    pr_info("disabling discrete graphics\n");
 
-    if (bbswitch_acpi_off())
-        pr_warn("The discrete card could not be disabled by an _OFF call\n");
-    dis_dev = NULL;
+    pci_set_power_state(bd->pdev, PCI_D3cold);
 }
 
-static void bbswitch_on(void) {
-    if (is_card_disabled() < 1)
-        return;
+static void bbswitch_pci_on(struct bbswitch_dev *bd) {
+    pci_set_power_state(bd->pdev, PCI_D0);
+    pci_restore_state(bd->pdev);
+    if (pci_enable_device(bd->pdev))
+        pr_warn("failed to enable %s\n", bd->name);
+    pci_set_master(bd->pdev);
+}
 
-    pr_info("enabling discrete graphics\n");
-
-    if (bbswitch_acpi_on())
-        pr_warn("The discrete card could not be enabled by an _ON call\n");
-    
-    int i = 0;
-    while(dis_dev == NULL){
-        msleep(500);
-        i++;
-        get_dis_dev();
-        if(i > 4){
-            break;
-        }
-    }
+static int bbswitch_pci_is_disabled(struct bbswitch_dev *bd) {
+    // the PCI core tracks the state we put the card in, so there is no need
+    // to wake the bridge for reading the configuration space
+    return bd->pdev->current_state == PCI_D3cold;
 }
 
-/* power bus so we can read PCI configuration space */
-static void dis_dev_get(void) {
-    if(is_card_disabled() < 1){
-        int i = 0;
-        while(dis_dev == NULL){
-            msleep(500);
-            i++;
-            get_dis_dev();
-            if(i > 4){
-                if(dis_dev != NULL){
-                    break;
-                }
-                else{
-                    return;
-                }
-            }
-        }
-        if (dis_dev->bus && dis_dev->bus->self)
-            pm_runtime_get_sync(&dis_dev->bus->self->dev);
+/* Optimus backend: _DSM function 0x1A prepares the card, _PS3 cuts power */
+static int bbswitch_optimus_probe(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    bd->dsm_handle = bd->handle;
+    if (skip_optimus_dsm ||
+        !handle_has_dsm_func(bd->dsm_handle, acpi_optimus_dsm_muid, 0x100, 0x1A))
+        return -ENODEV;
+    return 0;
+}
+
+static int bbswitch_optimus_off(struct bbswitch_dev *bd) {
+    if (bbswitch_optimus_dsm(bd)) {
+        pr_warn("Optimus ACPI call failed, the device is not disabled\n");
+        return 1;
     }
+    bbswitch_pci_off(bd);
+    return 0;
 }
 
-static void dis_dev_put(void) {
-    if(is_card_disabled() == 0){
-        if (dis_dev->bus && dis_dev->bus->self)
-            pm_runtime_put_sync(&dis_dev->bus->self->dev);
+static int bbswitch_optimus_on(struct bbswitch_dev *bd) {
+    bbswitch_pci_on(bd);
+    return 0;
+}
+
+/* legacy nVidia backend: _DSM function 3 switches the power */
+static int bbswitch_nvidia_probe(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    bd->dsm_handle = bd->handle;
+    if (handle_has_dsm_func(bd->dsm_handle, acpi_nvidia_dsm_muid, 0x102, 0x3))
+        return 0;
+
+    /* At least two Acer machines are known to use the intel ACPI handle
+     * with the legacy nvidia DSM */
+    bd->dsm_handle = igd_handle;
+    if (bd->dsm_handle &&
+        handle_has_dsm_func(bd->dsm_handle, acpi_nvidia_dsm_muid, 0x102, 0x3)) {
+        pr_info("detected a nVidia _DSM function on the"
+            " integrated video card for %s\n", bd->name);
+        return 0;
     }
+    return -ENODEV;
 }
 
-static ssize_t bbswitch_proc_write(struct file *fp, const char __user *buff,
-    size_t len, loff_t *off) {
-    char cmd[8];
+static int bbswitch_nvidia_off(struct bbswitch_dev *bd) {
+    bbswitch_pci_off(bd);
+    return bbswitch_nvidia_dsm(bd, 2);
+}
 
-    if (len >= sizeof(cmd))
-        len = sizeof(cmd) - 1;
+static int bbswitch_nvidia_on(struct bbswitch_dev *bd) {
+    int ret = bbswitch_nvidia_dsm(bd, 1);
 
-    if (copy_from_user(cmd, buff, len))
-        return -EFAULT;
+    bbswitch_pci_on(bd);
+    return ret;
+}
 
-    dis_dev_get();
+/* standard ACPI backend: _PR3 power resources handled by the ACPI core */
+static int bbswitch_pr3_probe(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    return acpi_has_method(bd->handle, "_PR3") ? 0 : -ENODEV;
+}
 
-    if (strncmp(cmd, "OFF", 3) == 0)
-        bbswitch_off();
+static int bbswitch_pr3_off(struct bbswitch_dev *bd) {
+    bbswitch_pci_off(bd);
+    return 0;
+}
 
-    if (strncmp(cmd, "ON", 2) == 0)
-        bbswitch_on();
+static int bbswitch_pr3_on(struct bbswitch_dev *bd) {
+    bbswitch_pci_on(bd);
+    return 0;
+}
 
-    dis_dev_put();
+/*
+ * Simulated power resource for testing without the hardware, only used with
+ * backend=sim. The cards are created at load time without a PCI device and
+ * appear on the "bus" sim_enum_ms after a successful power on.
+ */
+static int bbswitch_sim_probe(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    return bd->pdev ? -ENODEV : 0;
+}
 
-    return len;
+// Sleeps for the latency of the simulated AML call. Returns 0 on success.
+static int bbswitch_sim_call(struct bbswitch_dev *bd, const char *method,
+    unsigned int latency_ms) {
+    ktime_t start = ktime_get();
+    int err = 0;
+
+    msleep(latency_ms);
+    if (bbswitch_should_fail(FAULT_POWER) ||
+        (sim_fail_rate && get_random_u32() % 100 < sim_fail_rate))
+        err = AE_ERROR;
+    journal_aml(bd->name, method, err, start, -1);
+    if (err)
+        pr_warn("%s: simulated %s failed\n", bd->name, method);
+    return err;
 }
 
-static int bbswitch_proc_show(struct seq_file *seqfp, void *p) {
-    // show the card state. Example output: 0000:01:00:00 ON
-    dis_dev_get();
-    seq_printf(seqfp, "%s %s\n", dis_dev_name,
-             is_card_disabled() > 0 ? "OFF" : "ON");
-    dis_dev_put();
+static int bbswitch_sim_off(struct bbswitch_dev *bd) {
+    if (bbswitch_sim_call(bd, "_OFF", sim_off_ms))
+        return 1;
+    WRITE_ONCE(bd->sim_powered, false);
     return 0;
 }
-static int bbswitch_proc_open(struct inode *inode, struct file *file) {
-    return single_open(file, bbswitch_proc_show, NULL);
+
+static int bbswitch_sim_on(struct bbswitch_dev *bd) {
+    if (bbswitch_sim_call(bd, "_ON", sim_on_ms))
+        return 1;
+    bd->sim_ready = ktime_add_ms(ktime_get(), sim_enum_ms);
+    WRITE_ONCE(bd->sim_powered, true);
+    return 0;
 }
 
-static int bbswitch_pm_handler(struct notifier_block *nbp,
-    unsigned long event_type, void *p) {
-    switch (event_type) {
-    case PM_HIBERNATION_PREPARE:
-    case PM_SUSPEND_PREPARE:
-        pr_debug("Detected suspend");
-        dis_dev_get();
-        dis_before_suspend_disabled = is_card_disabled();
-        // enable the device before suspend to avoid the PCI config space from
-        // being saved incorrectly
-        if (dis_before_suspend_disabled)
-            pr_info("Enabling GPU for suspend");
-            bbswitch_on();
-        dis_dev_put();
-        break;
-    case PM_POST_HIBERNATION:
-    case PM_POST_SUSPEND:
-    case PM_POST_RESTORE:
-        pr_debug("Detected restore");
-        // after suspend, the card is on, but if it was off before suspend,
-        // disable it again
-        if (dis_before_suspend_disabled) {
-            pr_info("Restoring GPU to off");
-            dis_dev_get();
-            bbswitch_off();
-            dis_dev_put();
+static bool bbswitch_sim_enumerated(struct bbswitch_dev *bd) {
+    return ktime_after(ktime_get(), bd->sim_ready);
+}
+
+static int bbswitch_sim_is_disabled(struct bbswitch_dev *bd) {
+    if (!READ_ONCE(bd->sim_powered))
+        return 1;
+    return bbswitch_sim_enumerated(bd) ? 0 : -1;
+}
+
+// in order of preference, the first one that probes successfully is used
+static const struct bbswitch_backend bbswitch_backends[] = {
+    {
+        .name           = "g14",
+        .probe          = bbswitch_g14_probe,
+        .on             = bbswitch_g14_on,
+        .off            = bbswitch_g14_off,
+        .is_disabled    = bbswitch_g14_is_disabled,
+        .removes_device = true,
+    },
+    {
+        .name           = "optimus",
+        .probe          = bbswitch_optimus_probe,
+        .on             = bbswitch_optimus_on,
+        .off            = bbswitch_optimus_off,
+        .is_disabled    = bbswitch_pci_is_disabled,
+    },
+    {
+        .name           = "nvidia",
+        .probe          = bbswitch_nvidia_probe,
+        .on             = bbswitch_nvidia_on,
+        .off            = bbswitch_nvidia_off,
+        .is_disabled    = bbswitch_pci_is_disabled,
+    },
+    {
+        .name           = "pr3",
+        .probe          = bbswitch_pr3_probe,
+        .on             = bbswitch_pr3_on,
+        .off            = bbswitch_pr3_off,
+        .is_disabled    = bbswitch_pci_is_disabled,
+    },
+    {
+        .name           = "sim",
+        .probe          = bbswitch_sim_probe,
+        .on             = bbswitch_sim_on,
+        .off            = bbswitch_sim_off,
+        .is_disabled    = bbswitch_sim_is_disabled,
+        .enumerated     = bbswitch_sim_enumerated,
+        .removes_device = true,
+        .explicit_only  = true,
+    },
+};
+
+// Picks the power control backend of a card once, returns 0 if one is usable
+static int bbswitch_select_backend(struct bbswitch_dev *bd, acpi_handle igd_handle) {
+    const struct bbswitch_backend *be;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bbswitch_backends); i++) {
+        be = &bbswitch_backends[i];
+        if (backend && backend[0] ? strcmp(backend, be->name) :
+            be->explicit_only)
+            continue;
+        if (be->probe(bd, igd_handle) == 0) {
+            bd->backend = be;
+            pr_info("using %s backend for %s\n", be->name, bd->name);
+            return 0;
         }
-        break;
-    case PM_RESTORE_PREPARE:
-        // deliberately don't do anything as it does not occur before suspend
-        // nor hibernate, but before restoring a saved image. In that case,
-        // either PM_POST_HIBERNATION or PM_POST_RESTORE will be called
-        break;
     }
-    return 0;
+
+    pr_err("No suitable power control method found for %s.\n", bd->name);
+    return -ENODEV;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-static struct proc_ops bbswitch_fops = {
-    .proc_open   = bbswitch_proc_open,
-    .proc_read   = seq_read,
+static const char *bbswitch_state_name(int state) {
+    switch (state) {
+    case CARD_OFF:
+        return "OFF";
+    case CARD_TRANSITIONING:
+        return "TRANSITIONING";
+    case CARD_TIMEOUT:
+        return "TIMEOUT";
+    case CARD_STANDBY:
+        return "STANDBY";
+    case CARD_READY:
+        return "READY";
+    case CARD_UNCHANGED:
+        return "UNKNOWN";
+    }
+    return "ON";
+}
+
+// The state as reported to userspace, READY instead of ON once the driver
+// is bound if autobind is used
+static int bbswitch_reported_state(struct bbswitch_dev *bd, int state) {
+    if (state == CARD_ON && READ_ONCE(autobind_enabled) &&
+        READ_ONCE(bd->ready))
+        return CARD_READY;
+    return state;
+}
+
+// Publishes a new cached state and wakes up whoever polls the device node
+static void bbswitch_set_state(struct bbswitch_dev *bd, int state) {
+    int old = READ_ONCE(bd->state);
+
+    if (old == state)
+        return;
+    metrics_state(bd, old, state);
+    WRITE_ONCE(bd->state, state);
+    atomic_inc(&bd->state_changes);
+    wake_up_all(&bd->transition_wq);
+}
+
+// Tells udev about a state change of the card. pm is "suspend" or "resume"
+// for the events sent by the PM notifier, NULL otherwise.
+static void bbswitch_uevent(struct bbswitch_dev *bd, int state, int cause,
+    const char *pm) {
+    char card_env[32], state_env[32], cause_env[32], pm_env[32];
+    char *envp[] = { card_env, state_env, cause_env, pm ? pm_env : NULL, NULL };
+
+    // the device node is gone or was never registered
+    if (!bd->proc_entry || !bd->misc.this_device)
+        return;
+
+    snprintf(card_env, sizeof(card_env), "BBSWITCH_CARD=%s", bd->name);
+    snprintf(state_env, sizeof(state_env), "BBSWITCH_STATE=%s",
+        bbswitch_state_name(bbswitch_reported_state(bd, state)));
+    snprintf(cause_env, sizeof(cause_env), "BBSWITCH_CAUSE=%s",
+        journal_causes[cause]);
+    if (pm)
+        snprintf(pm_env, sizeof(pm_env), "BBSWITCH_PM=%s", pm);
+    kobject_uevent_env(&bd->misc.this_device->kobj, KOBJ_CHANGE, envp);
+}
+
+/*
+ * Stages of a card, from the firmware and the bus. The transition worker
+ * moves a card through them and records when each stage was reached, so
+ * that readers can tell how far a transition got without waiting for it.
+ */
+static const char * const stage_names[BBSWITCH_STAGES] = {
+    [BBSWITCH_STAGE_OFF]            = "OFF",
+    [BBSWITCH_STAGE_POWERING_ON]    = "POWERING_ON",
+    [BBSWITCH_STAGE_LINK_UP]        = "LINK_UP",
+    [BBSWITCH_STAGE_ENUMERATED]     = "ENUMERATED",
+    [BBSWITCH_STAGE_DRIVER_BOUND]   = "DRIVER_BOUND",
+    [BBSWITCH_STAGE_POWERING_OFF]   = "POWERING_OFF",
+    [BBSWITCH_STAGE_ERROR]          = "ERROR",
+};
+
+static bool stage_enumerated(int stage) {
+    return stage == BBSWITCH_STAGE_ENUMERATED ||
+        stage == BBSWITCH_STAGE_DRIVER_BOUND;
+}
+
+// Whether the root port above the card reports the link as active
+static bool bbswitch_link_active(struct bbswitch_dev *bd) {
+    struct pci_bus *bus;
+    u16 lnksta = 0;
+
+    pci_lock_rescan_remove();
+    bus = pci_find_bus(bd->domain, bd->bus);
+    if (bus && bus->self && bus->self->link_active_reporting)
+        pcie_capability_read_word(bus->self, PCI_EXP_LNKSTA, &lnksta);
+    pci_unlock_rescan_remove();
+    return lnksta & PCI_EXP_LNKSTA_DLLLA;
+}
+
+// Reads the stage the card is in, or returns -EIO if the firmware could not
+// tell. Never returns POWERING_OFF or ERROR, which only the transitions know
+// about.
+static int bbswitch_probe_stage(struct bbswitch_dev *bd) {
+    int disabled = bd->backend->is_disabled(bd);
+
+    if (disabled == -EIO)
+        return -EIO;
+    if (disabled > 0)
+        return BBSWITCH_STAGE_OFF;
+    if (disabled < 0)
+        return bbswitch_link_active(bd) ? BBSWITCH_STAGE_LINK_UP :
+            BBSWITCH_STAGE_POWERING_ON;
+    return bd->pdev && bd->pdev->driver ? BBSWITCH_STAGE_DRIVER_BOUND :
+        BBSWITCH_STAGE_ENUMERATED;
+}
+
+// Moves the card to stage. Powering on or off starts a new transition and
+// forgets when the stages of the previous one were reached.
+static void bbswitch_set_stage(struct bbswitch_dev *bd, int stage) {
+    ktime_t now = ktime_get();
+    int old;
+
+    spin_lock(&bd->req_lock);
+    old = bd->stage;
+    if (old != stage) {
+        bd->stage_ns[old] += ktime_to_ns(ktime_sub(now, bd->stage_since));
+        bd->stage_since = now;
+        WRITE_ONCE(bd->stage, stage);
+    }
+    if (stage == BBSWITCH_STAGE_POWERING_ON ||
+        stage == BBSWITCH_STAGE_POWERING_OFF)
+        memset(bd->stage_time, 0, sizeof(bd->stage_time));
+    if (old != stage || !bd->stage_time[stage])
+        bd->stage_time[stage] = now;
+    spin_unlock(&bd->req_lock);
+}
+
+// Follows a powered card from POWERING_ON to LINK_UP while waiting for it
+static void bbswitch_track_link(struct bbswitch_dev *bd) {
+    if (READ_ONCE(bd->stage) == BBSWITCH_STAGE_POWERING_ON &&
+        bbswitch_link_active(bd))
+        bbswitch_set_stage(bd, BBSWITCH_STAGE_LINK_UP);
+}
+
+// Takes READY from the card itself, the bus notifier misses drivers bound
+// before it was registered or while the card was off the bus
+static void bbswitch_sync_ready(struct bbswitch_dev *bd) {
+    WRITE_ONCE(bd->ready, bd->pdev && bd->pdev->driver);
+}
+
+// Refreshes the cached card state. This does not need the bridge to be
+// resumed. When the firmware cannot tell, a card on the bus is still known to
+// be powered, otherwise the state is unknown until the next read.
+static int bbswitch_cache_state(struct bbswitch_dev *bd) {
+    int stage = bbswitch_probe_stage(bd);
+    int state;
+
+    if (stage < 0 && !bbswitch_enumerated(bd))
+        state = CARD_UNCHANGED;
+    else if (stage == BBSWITCH_STAGE_OFF)
+        state = CARD_OFF;
+    else
+        state = bd->standby ? CARD_STANDBY : CARD_ON;
+
+    bbswitch_sync_ready(bd);
+    bbswitch_set_state(bd, state);
+    return state;
+}
+
+/*
+ * Observed latency between _ON and the card showing up on the bus. It is a
+ * property of the machine, so it is shared by all cards.
+ */
+#define ON_LATENCY_SAMPLES 16
+static DEFINE_SPINLOCK(on_latency_lock);
+static u32 on_latency_samples[ON_LATENCY_SAMPLES];
+static unsigned int on_latency_count;
+
+static void on_latency_record(u32 us) {
+    u32 ewma;
+
+    spin_lock(&on_latency_lock);
+    // exponentially weighted moving average with a weight of 1/8
+    ewma = on_latency_us ? (on_latency_us * 7 + us) / 8 : us;
+    WRITE_ONCE(on_latency_us, ewma);
+    on_latency_samples[on_latency_count++ % ON_LATENCY_SAMPLES] = us;
+    spin_unlock(&on_latency_lock);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Returns the 90th percentile of the recent samples, or the average if
+// nothing was measured yet
+static u32 on_latency_p90(void) {
+    u32 sorted[ON_LATENCY_SAMPLES];
+    unsigned int n;
+
+    spin_lock(&on_latency_lock);
+    n = min_t(unsigned int, on_latency_count, ON_LATENCY_SAMPLES);
+    memcpy(sorted, on_latency_samples, n * sizeof(u32));
+    spin_unlock(&on_latency_lock);
+
+    if (n == 0)
+        return READ_ONCE(on_latency_us);
+    sort(sorted, n, sizeof(u32), cmp_u32, NULL);
+    return sorted[(n * 9 - 1) / 10];
+}
+
+// Waits for the card to appear on the bus after _ON was called at start.
+// Sleeps until shortly before the card is expected, then polls in steps of
+// a fraction of the expected latency. Past twice the 90th percentile the card
+// is late and polling slows down. Returns -ETIMEDOUT after enum_timeout.
+static int bbswitch_wait_enumerated(struct bbswitch_dev *bd, ktime_t start) {
+    ktime_t deadline = ktime_add_ms(start, enum_timeout);
+    u32 expected = READ_ONCE(on_latency_us);
+    ktime_t late = KTIME_MAX;
+    u32 step = 10000;
+    s64 early;
+
+    if (bbswitch_enumerated(bd))
+        return 0;
+
+    if (expected) {
+        late = ktime_add_us(start, 2 * on_latency_p90());
+        early = expected * 7 / 8 - ktime_us_delta(ktime_get(), start);
+        if (early > 0)
+            usleep_range(early, early + expected / 8);
+        step = clamp_val(expected / 16, 1000, 50000);
+    }
+
+    for (;;) {
+        if (bbswitch_enumerated(bd))
+            return 0;
+        bbswitch_track_link(bd);
+        if (ktime_after(ktime_get(), deadline))
+            return -ETIMEDOUT;
+        if (ktime_after(ktime_get(), late))
+            step = 50000;
+        usleep_range(step, step + step / 4);
+    }
+}
+
+/*
+ * Link power management between the root port and the card. The link often
+ * comes back from _ON with ASPM disabled, and cutting the power resource while
+ * the link is active skips the L2/L3 Ready handshake.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static void bbswitch_link_enable_aspm(struct bbswitch_dev *bd) {
+    int states = PCIE_LINK_STATE_L1;
+
+    if (!bd->pdev || !aspm)
+        return;
+
+    if (aspm >= 2)
+        states |= PCIE_LINK_STATE_L1_1 | PCIE_LINK_STATE_L1_2 |
+            PCIE_LINK_STATE_L1_1_PCIPM | PCIE_LINK_STATE_L1_2_PCIPM;
+    if (pci_enable_link_state(bd->pdev, states))
+        pr_debug("%s: could not enable ASPM L1%s\n", bd->name,
+            aspm >= 2 ? " substates" : "");
+}
+#else
+static void bbswitch_link_enable_aspm(struct bbswitch_dev *bd) {
+    // pci_enable_link_state() is not exported before 6.3
+}
+#endif
+
+// Puts the card in D3hot so that the link is idle before the power resource
+// is turned off. Returns true if bbswitch_link_restore() must undo it.
+static bool bbswitch_link_quiesce(struct bbswitch_dev *bd) {
+    if (!bd->pdev || !link_quiesce)
+        return false;
+
+    pci_clear_master(bd->pdev);
+    if (pci_is_enabled(bd->pdev))
+        pci_disable_device(bd->pdev);
+    pci_set_power_state(bd->pdev, PCI_D3hot);
+    return true;
+}
+
+// Brings a quiesced card back after the power resource failed to turn off
+static void bbswitch_link_restore(struct bbswitch_dev *bd) {
+    pci_set_power_state(bd->pdev, PCI_D0);
+    if (pci_enable_device(bd->pdev))
+        pr_warn("failed to enable %s\n", bd->name);
+    bbswitch_link_enable_aspm(bd);
+}
+
+// Whether the runtime PM usage count of a device with a driver tells if it is
+// in use. Drivers without runtime PM callbacks, such as the proprietary nvidia
+// one, do not raise it for their clients, and neither is it meaningful while
+// runtime PM is forbidden through power/control.
+static bool bbswitch_dev_pm_aware(struct pci_dev *dev) {
+    const struct dev_pm_ops *pm = dev->dev.driver->pm;
+
+    return pm && pm->runtime_suspend && dev->dev.power.runtime_auto;
+}
+
+// Whether a runtime PM aware device with a driver is in use. Drivers hold a
+// runtime PM reference while they are open.
+static bool bbswitch_dev_in_use(struct pci_dev *dev) {
+    return atomic_read(&dev->dev.power.usage_count) > 0;
+}
+
+// Unbinds the drivers of all functions in the card's slot, such as its audio
+// and USB controllers. Returns -EBUSY without unbinding anything if one of
+// them is in use or cannot tell.
+static int bbswitch_unbind_slot(struct bbswitch_dev *bd) {
+    struct pci_dev *fns[8];
+    int i, n = 0, ret = 0;
+
+    for (i = 0; i < 8; i++) {
+        struct pci_dev *dev = pci_get_slot(bd->pdev->bus,
+            PCI_DEVFN(PCI_SLOT(bd->devfn), i));
+
+        if (!dev)
+            continue;
+        if (dev->driver && !bbswitch_dev_pm_aware(dev)) {
+            pr_warn("cannot tell if driver '%s' of %s is in use, refusing"
+                " FORCE-UNBIND\n", dev->driver->name, pci_name(dev));
+            ret = -EBUSY;
+        } else if (dev->driver && bbswitch_dev_in_use(dev)) {
+            pr_warn("device %s is in use by driver '%s', refusing"
+                " FORCE-UNBIND\n", pci_name(dev), dev->driver->name);
+            ret = -EBUSY;
+        }
+        fns[n++] = dev;
+    }
+
+    // the graphics function last, the others may depend on it
+    while (n--) {
+        if (!ret && fns[n]->driver) {
+            pr_info("unbinding driver '%s' from %s\n", fns[n]->driver->name,
+                pci_name(fns[n]));
+            device_release_driver(&fns[n]->dev);
+        }
+        pci_dev_put(fns[n]);
+    }
+    return ret;
+}
+
+// Turns the power off, returns 0 or -EIO if the firmware failed to. With
+// quiesce, the link is idled first unless the PCI core handles it. The caller
+// drops the reference to a card that leaves the bus.
+static int bbswitch_power_off(struct bbswitch_dev *bd, bool quiesce) {
+    bool quiesced = false;
+    int ret = 0;
+
+    bbswitch_set_stage(bd, BBSWITCH_STAGE_POWERING_OFF);
+    mutex_lock(&bd->power_lock);
+    // the D3cold backends leave the link to the PCI core
+    if (quiesce && bd->backend->removes_device)
+        quiesced = bbswitch_link_quiesce(bd);
+
+    if (bd->backend->off(bd)) {
+        pr_warn("The discrete card could not be disabled\n");
+        if (quiesced) {
+            bbswitch_link_restore(bd);
+            bd->standby = false;
+        }
+        ret = -EIO;
+    } else {
+        bd->standby = false;
+    }
+    mutex_unlock(&bd->power_lock);
+    bbswitch_set_stage(bd, ret ? BBSWITCH_STAGE_ERROR : BBSWITCH_STAGE_OFF);
+    return ret;
+}
+
+// Returns 0 if the card is off, -EBUSY if it is still in use and -EIO if the
+// firmware failed to turn it off. With BBSWITCH_SET_FORCE_UNBIND in flags,
+// idle drivers are unbound first.
+static int bbswitch_off(struct bbswitch_dev *bd, unsigned int flags) {
+    int ret;
+
+    if (bbswitch_probe_stage(bd) == BBSWITCH_STAGE_OFF) {
+        bbswitch_set_stage(bd, BBSWITCH_STAGE_OFF);
+        bbswitch_cache_state(bd);
+        pr_info("discrete graphics %s already disabled\n", bd->name);
+        return 0;
+    }
+
+    if (bd->hold_count) {
+        pr_warn("device %s is held on by %u process(es), refusing OFF\n",
+            bd->name, bd->hold_count);
+        return -EBUSY;
+    }
+
+    if (bd->pdev && (flags & BBSWITCH_SET_FORCE_UNBIND)) {
+        ret = bbswitch_unbind_slot(bd);
+        if (ret)
+            return ret;
+    }
+
+    if (bd->pdev && bd->pdev->driver) {
+        pr_warn("device %s is in use by driver '%s', refusing OFF\n",
+            bd->name, bd->pdev->driver->name);
+        return -EBUSY;
+    }
+
+    pr_info("disabling discrete graphics %s\n", bd->name);
+
+    ret = bbswitch_power_off(bd, true);
+    if (bd->backend->removes_device)
+        put_dis_dev(bd);
+    bbswitch_cache_state(bd);
+    return ret;
+}
+
+// One power on attempt, returns 0 once the card is back on the bus. A
+// firmware failure is returned at once, the card will not show up then.
+static int bbswitch_power_on_once(struct bbswitch_dev *bd) {
+    ktime_t start = ktime_get();
+    int stage;
+
+    bbswitch_set_stage(bd, BBSWITCH_STAGE_POWERING_ON);
+    mutex_lock(&bd->power_lock);
+    if (bd->backend->on(bd)) {
+        mutex_unlock(&bd->power_lock);
+        pr_warn("The discrete card could not be enabled\n");
+        bbswitch_set_stage(bd, BBSWITCH_STAGE_ERROR);
+        return -EIO;
+    }
+
+    if (bd->backend->removes_device && !bbswitch_enumerated(bd) &&
+        bbswitch_wait_enumerated(bd, start) == 0)
+        on_latency_record(ktime_us_delta(ktime_get(), start));
+    mutex_unlock(&bd->power_lock);
+
+    stage = bbswitch_probe_stage(bd);
+    bbswitch_set_stage(bd, stage_enumerated(stage) ? stage :
+        BBSWITCH_STAGE_ERROR);
+    return stage_enumerated(stage) ? 0 : -EIO;
+}
+
+// Counts consecutive power on failures and opens the circuit breaker once
+// there are breaker_threshold of them
+static void bbswitch_breaker_update(struct bbswitch_dev *bd, int ret) {
+    spin_lock(&bd->req_lock);
+    if (ret == 0) {
+        bd->on_failures = 0;
+        bd->breaker_open = false;
+    } else if (++bd->on_failures >= breaker_threshold && breaker_threshold) {
+        bd->breaker_open = true;
+        bd->breaker_until = jiffies + msecs_to_jiffies(breaker_cooldown);
+        pr_warn("%s failed to power on %u times, refusing ON for %u ms\n",
+            bd->name, bd->on_failures, breaker_cooldown);
+    }
+    spin_unlock(&bd->req_lock);
+}
+
+// Returns true while ON requests must fail fast. After the cooldown one
+// attempt is let through, another failure opens the breaker again.
+static bool bbswitch_breaker_tripped(struct bbswitch_dev *bd) {
+    bool tripped;
+
+    spin_lock(&bd->req_lock);
+    if (bd->breaker_open && time_after_eq(jiffies, bd->breaker_until))
+        bd->breaker_open = false;
+    tripped = bd->breaker_open;
+    spin_unlock(&bd->req_lock);
+    return tripped;
+}
+
+static void bbswitch_breaker_reset(struct bbswitch_dev *bd) {
+    spin_lock(&bd->req_lock);
+    bd->on_failures = 0;
+    bd->breaker_open = false;
+    spin_unlock(&bd->req_lock);
+    pr_info("%s: power on failure count reset\n", bd->name);
+}
+
+// Brings a card in standby back to D0, this only takes the D3hot recovery time
+static void bbswitch_standby_exit(struct bbswitch_dev *bd) {
+    if (bd->pdev) {
+        pci_set_power_state(bd->pdev, PCI_D0);
+        pci_restore_state(bd->pdev);
+        pci_set_master(bd->pdev);
+    }
+    bd->standby = false;
+    pr_info("discrete graphics %s resumed from standby\n", bd->name);
+}
+
+// Returns 0 if the card is on and -EIO if it did not come up, even after
+// on_retries further attempts. Attempts that could not finish within
+// transition_timeout are skipped, so that the failure reaches the requester.
+static int bbswitch_on(struct bbswitch_dev *bd) {
+    unsigned int delay = on_retry_delay;
+    ktime_t start = ktime_get();
+    unsigned int attempt;
+    int ret, stage;
+
+    if (bd->standby) {
+        bbswitch_standby_exit(bd);
+        bbswitch_cache_state(bd);
+        return 0;
+    }
+
+    stage = bbswitch_probe_stage(bd);
+    if (stage_enumerated(stage)) {
+        bbswitch_set_stage(bd, stage);
+        bbswitch_cache_state(bd);
+        return 0;
+    }
+
+    pr_info("enabling discrete graphics %s\n", bd->name);
+
+    for (attempt = 0; ; attempt++) {
+        ret = bbswitch_power_on_once(bd);
+        if (ret == 0 || attempt >= on_retries)
+            break;
+        if (transition_timeout && ktime_ms_delta(ktime_get(), start) +
+            delay + enum_timeout >= transition_timeout) {
+            pr_warn("%s did not come up, no time left to retry\n", bd->name);
+            break;
+        }
+        pr_warn("%s did not come up, retrying in %u ms\n", bd->name, delay);
+        msleep(delay);
+        delay *= 2;
+    }
+
+    if (ret == 0)
+        bbswitch_link_enable_aspm(bd);
+    bbswitch_breaker_update(bd, ret);
+    bbswitch_cache_state(bd);
+    return ret;
+}
+
+// Puts a powered card in D3hot, keeping it enumerated and its power resource
+// on so that it comes back without running AML. Powers the card on first if
+// it is off. Returns 0, -EBUSY if it is in use or the error of bbswitch_on().
+static int bbswitch_standby(struct bbswitch_dev *bd) {
+    int ret;
+
+    if (bd->standby) {
+        bbswitch_cache_state(bd);
+        return 0;
+    }
+
+    if (bd->hold_count) {
+        pr_warn("device %s is held on by %u process(es), refusing STANDBY\n",
+            bd->name, bd->hold_count);
+        return -EBUSY;
+    }
+
+    if (bd->pdev && bd->pdev->driver) {
+        pr_warn("device %s is in use by driver '%s', refusing STANDBY\n",
+            bd->name, bd->pdev->driver->name);
+        return -EBUSY;
+    }
+
+    ret = bbswitch_on(bd);
+    if (ret)
+        return ret;
+
+    pr_info("putting discrete graphics %s in standby\n", bd->name);
+    if (bd->pdev) {
+        pci_save_state(bd->pdev);
+        pci_clear_master(bd->pdev);
+        pci_set_power_state(bd->pdev, PCI_D3hot);
+    }
+    bd->standby = true;
+    bbswitch_cache_state(bd);
+    return 0;
+}
+
+/* power bus so we can read PCI configuration space. Returns the bridge that
+ * must be passed to dis_dev_put(), NULL if nothing was resumed. */
+static struct pci_dev *dis_dev_get(struct bbswitch_dev *bd) {
+    struct pci_dev *bridge;
+    int stage = bbswitch_probe_stage(bd);
+
+    // without SGST, only a card that is on the bus is known to be powered
+    if (stage < 0 && bbswitch_enumerated(bd))
+        stage = BBSWITCH_STAGE_ENUMERATED;
+    if (stage >= 0 && stage != BBSWITCH_STAGE_OFF) {
+        // powered but possibly not enumerated yet
+        if (!stage_enumerated(stage) &&
+            bbswitch_wait_enumerated(bd, ktime_get()))
+            return NULL;
+        // simulated cards have no PCI device
+        if (bd->pdev && bd->pdev->bus && bd->pdev->bus->self) {
+            bridge = pci_dev_get(bd->pdev->bus->self);
+            pm_runtime_get_sync(&bridge->dev);
+            return bridge;
+        }
+    }
+    return NULL;
+}
+
+static void dis_dev_put(struct pci_dev *bridge) {
+    if (bridge) {
+        pm_runtime_put_sync(&bridge->dev);
+        pci_dev_put(bridge);
+    }
+}
+
+static bool bbswitch_request_done(struct bbswitch_dev *bd, u64 seq) {
+    bool done;
+
+    spin_lock(&bd->req_lock);
+    done = bd->done_seq >= seq;
+    spin_unlock(&bd->req_lock);
+    return done;
+}
+
+static int bbswitch_command(int target) {
+    return target == CARD_ON ? BBSWITCH_JOURNAL_ON :
+        target == CARD_STANDBY ? BBSWITCH_JOURNAL_STANDBY : BBSWITCH_JOURNAL_OFF;
+}
+
+// Sets the driver_override of a card, an empty driver clears it
+static int bbswitch_set_override(struct pci_dev *pdev, const char *driver) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    return driver_set_override(&pdev->dev, &pdev->driver_override,
+        driver, strlen(driver));
+#else
+    char *old, *override = NULL;
+
+    if (driver[0]) {
+        override = kstrdup(driver, GFP_KERNEL);
+        if (!override)
+            return -ENOMEM;
+    }
+    device_lock(&pdev->dev);
+    old = pdev->driver_override;
+    pdev->driver_override = override;
+    device_unlock(&pdev->dev);
+    kfree(old);
+    return 0;
+#endif
+}
+
+// Undoes the driver_override set by bind_work
+static void bbswitch_clear_override(struct bbswitch_dev *bd) {
+    if (!READ_ONCE(bd->overridden))
+        return;
+    // a card that left the bus took its override with it
+    if (bd->pdev && bbswitch_set_override(bd->pdev, ""))
+        pr_warn("%s: cannot clear driver_override\n", bd->name);
+    WRITE_ONCE(bd->overridden, false);
+}
+
+// Binds the autobind driver to a card that was just powered on. The driver
+// probes here, in parallel with the requester that was woken up already.
+static void bbswitch_bind_work(struct work_struct *work) {
+    struct bbswitch_dev *bd = container_of(work, struct bbswitch_dev,
+        bind_work);
+    char driver[sizeof(autobind)];
+    struct pci_dev *pdev;
+    ktime_t start = ktime_get();
+    int ret;
+
+    spin_lock(&autobind_lock);
+    strscpy(driver, autobind, sizeof(driver));
+    spin_unlock(&autobind_lock);
+    if (!driver[0])
+        return;
+
+    mutex_lock(&bd->lock);
+    pdev = pci_dev_get(bd->pdev);
+    mutex_unlock(&bd->lock);
+    if (!pdev)
+        return;
+
+    if (strcmp(driver, "any")) {
+        // like modprobe, but without waiting for userspace to run it
+        request_module("%s", driver);
+        ret = bbswitch_set_override(pdev, driver);
+        if (ret)
+            pr_warn("%s: cannot select driver %s: %d\n", bd->name, driver, ret);
+        else
+            WRITE_ONCE(bd->overridden, true);
+    }
+
+    ret = device_attach(&pdev->dev);
+    if (ret > 0)
+        pr_info("%s: %s bound after %lld us\n", bd->name,
+            dev_driver_string(&pdev->dev), ktime_us_delta(ktime_get(), start));
+    else
+        pr_warn("%s: no driver could be bound: %d\n", bd->name, ret);
+    pci_dev_put(pdev);
+}
+
+static void bbswitch_gov_replay(struct bbswitch_dev *bd);
+
+// Runs the requested transitions. AML may hang in here, requesters only wait
+// for it up to their deadline.
+static void bbswitch_transition_work(struct work_struct *work) {
+    struct bbswitch_dev *bd = container_of(work, struct bbswitch_dev,
+        transition_work);
+    char comm[TASK_COMM_LEN];
+    struct pci_dev *bridge;
+    int target, result, state, cause, command;
+    unsigned int flags;
+    ktime_t start;
+    pid_t pid;
+    u64 seq;
+
+    spin_lock(&bd->req_lock);
+    target = bd->target;
+    flags = bd->req_flags;
+    seq = bd->request_seq;
+    cause = bd->req_cause;
+    pid = bd->req_pid;
+    memcpy(comm, bd->req_comm, sizeof(comm));
+    spin_unlock(&bd->req_lock);
+
+    start = ktime_get();
+    mutex_lock(&bd->lock);
+    bbswitch_set_state(bd, CARD_TRANSITIONING);
+    bbswitch_uevent(bd, CARD_TRANSITIONING, cause, NULL);
+    bridge = dis_dev_get(bd);
+    if (target == CARD_ON)
+        result = bbswitch_on(bd);
+    else if (target == CARD_STANDBY)
+        result = bbswitch_standby(bd);
+    else
+        result = bbswitch_off(bd, flags);
+    dis_dev_put(bridge);
+    state = bbswitch_cache_state(bd);
+    mutex_unlock(&bd->lock);
+
+    command = bbswitch_command(target);
+    journal_add(bd->name, cause, pid, comm, command, bd->backend->name,
+        result, start, state);
+    metrics_transition(bd, cause, command, result);
+
+    // also replaces a TIMEOUT reported while we were stuck
+    spin_lock(&bd->req_lock);
+    bd->done_seq = seq;
+    bd->result = result;
+    bbswitch_set_state(bd, state);
+    spin_unlock(&bd->req_lock);
+    wake_up_all(&bd->transition_wq);
+    bbswitch_uevent(bd, state, cause, NULL);
+
+    if (target == CARD_ON && state == CARD_ON &&
+        READ_ONCE(autobind_enabled) && !READ_ONCE(bd->ready))
+        queue_work(bbswitch_wq, &bd->bind_work);
+    bbswitch_gov_replay(bd);
+}
+
+// Asks the worker to switch the card on or off. Returns the sequence number
+// to wait for, or -EAGAIN if the circuit breaker refuses ON. cause is one of
+// BBSWITCH_CAUSE_*, flags of BBSWITCH_SET_*.
+static s64 bbswitch_submit(struct bbswitch_dev *bd, int target, int cause,
+    unsigned int flags) {
+    u64 seq;
+
+    // STANDBY needs to power on an OFF card as well
+    if (target != CARD_OFF && bbswitch_breaker_tripped(bd)) {
+        pr_warn_ratelimited("%s: refusing ON after %u failed attempts, write"
+            " RESET to retry now\n", bd->name, bd->on_failures);
+        metrics_refusal(bd, REFUSAL_BREAKER, bbswitch_command(target));
+        return -EAGAIN;
+    }
+
+    spin_lock(&bd->req_lock);
+    bd->target = target;
+    bd->req_cause = cause;
+    bd->req_flags = flags;
+    if (cause == BBSWITCH_CAUSE_USER || cause == BBSWITCH_CAUSE_HOLD) {
+        bd->req_pid = task_pid_nr(current);
+        get_task_comm(bd->req_comm, current);
+    } else {
+        bd->req_pid = 0;
+        bd->req_comm[0] = '\0';
+    }
+    seq = ++bd->request_seq;
+    spin_unlock(&bd->req_lock);
+
+    queue_work(bbswitch_wq, &bd->transition_work);
+    return seq;
+}
+
+// Waits at most timeout_ms (0 is forever) for the transition numbered seq.
+// Returns its result or -ETIMEDOUT.
+static int bbswitch_wait_request(struct bbswitch_dev *bd, u64 seq,
+    unsigned int timeout_ms) {
+    unsigned long timeout = MAX_SCHEDULE_TIMEOUT;
+    int ret;
+
+    if (timeout_ms)
+        timeout = msecs_to_jiffies(timeout_ms);
+    if (!wait_event_timeout(bd->transition_wq, bbswitch_request_done(bd, seq),
+        timeout))
+        return -ETIMEDOUT;
+
+    spin_lock(&bd->req_lock);
+    ret = bd->result;
+    spin_unlock(&bd->req_lock);
+    return ret;
+}
+
+// Waits for at most transition_timeout ms for the transition numbered seq.
+// Returns its result, or -ETIMEDOUT after reporting the card as stuck.
+static int bbswitch_wait_deadline(struct bbswitch_dev *bd, u64 seq) {
+    int ret = bbswitch_wait_request(bd, seq, transition_timeout);
+    bool stuck;
+    int cause;
+
+    if (ret != -ETIMEDOUT)
+        return ret;
+
+    spin_lock(&bd->req_lock);
+    stuck = bd->done_seq < seq;
+    if (stuck)
+        bbswitch_set_state(bd, CARD_TIMEOUT);
+    else
+        ret = bd->result;
+    cause = bd->req_cause;
+    spin_unlock(&bd->req_lock);
+    // the worker finished right after the wait timed out
+    if (!stuck)
+        return ret;
+
+    bbswitch_uevent(bd, CARD_TIMEOUT, cause, NULL);
+    atomic_inc(&bd->stuck_transitions);
+    pr_warn("%s: switching the card did not finish within %u ms\n",
+        bd->name, transition_timeout);
+    return -ETIMEDOUT;
+}
+
+/*
+ * Governors decide what the events concerning a card mean for its power
+ * state. Every transition goes through bbswitch_decide(), which asks the
+ * active governor and submits its answer to the transition worker.
+ */
+enum {
+    GOV_EV_USER,            /* arg: state written by the user */
+    GOV_EV_HOLD,            /* first hold taken */
+    GOV_EV_RELEASE,         /* last hold dropped, arg: state to restore */
+    GOV_EV_SUSPEND,
+    GOV_EV_RESUME,          /* arg: state before suspend */
+    GOV_EV_INIT,            /* arg: load_state */
+    GOV_EV_EXIT,            /* arg: unload_state */
+    GOV_EV_POWER_SOURCE,    /* arg: POLICY_AC or POLICY_BATTERY */
+    GOV_EV_BIND,            /* a driver was bound to the card */
+    GOV_EV_UNBIND,
+    GOV_EV_TIMER,           /* the timer armed by the governor expired */
+    GOV_EV_RECONCILE,       /* arg: state to restore after a mismatch */
+};
+
+enum {
+    POLICY_AC,
+    POLICY_BATTERY,
+};
+
+static int policy_source = -1;
+
+struct bbswitch_governor {
+    const char *name;
+    // returns the state to switch to, or CARD_UNCHANGED
+    int (*event)(struct bbswitch_dev *bd, int event, int arg);
+    // optional, called when the governor is selected and deselected
+    void (*start)(struct bbswitch_dev *bd);
+    void (*stop)(struct bbswitch_dev *bd);
+};
+
+static void bbswitch_gov_arm(struct bbswitch_dev *bd, unsigned int ms) {
+    mod_delayed_work(system_freezable_wq, &bd->gov_work,
+        msecs_to_jiffies(ms));
+}
+
+static void bbswitch_gov_disarm(struct bbswitch_dev *bd) {
+    cancel_delayed_work(&bd->gov_work);
+}
+
+static bool bbswitch_gov_idle(struct bbswitch_dev *bd) {
+    return !READ_ONCE(bd->hold_count) && !(bd->pdev && bd->pdev->driver);
+}
+
+/* manual: only switches when asked to, the behaviour without governors */
+static int bbswitch_gov_manual_event(struct bbswitch_dev *bd, int event,
+    int arg) {
+    switch (event) {
+    case GOV_EV_USER:
+    case GOV_EV_RECONCILE:
+    case GOV_EV_RELEASE:
+        return arg;
+    case GOV_EV_HOLD:
+    case GOV_EV_SUSPEND:
+        return CARD_ON;
+    case GOV_EV_RESUME:
+        return arg == CARD_OFF || arg == CARD_STANDBY ? arg : CARD_UNCHANGED;
+    case GOV_EV_INIT:
+    case GOV_EV_EXIT:
+        return arg == CARD_OFF || arg == CARD_ON ? arg : CARD_UNCHANGED;
+    case GOV_EV_POWER_SOURCE:
+        arg = arg == POLICY_AC ? ac_state : battery_state;
+        return arg == CARD_OFF || arg == CARD_ON ? arg : CARD_UNCHANGED;
+    }
+    return CARD_UNCHANGED;
+}
+
+/* autosuspend-timer: turns the card off autosuspend_delay ms after it was
+ * last used by a driver or a holder */
+static int bbswitch_gov_autosuspend_event(struct bbswitch_dev *bd, int event,
+    int arg) {
+    switch (event) {
+    case GOV_EV_UNBIND:
+    case GOV_EV_INIT:
+        bbswitch_gov_arm(bd, autosuspend_delay);
+        break;
+    case GOV_EV_RELEASE:
+        bbswitch_gov_arm(bd, autosuspend_delay);
+        return CARD_UNCHANGED;
+    case GOV_EV_USER:
+        if (arg == CARD_ON)
+            bbswitch_gov_arm(bd, autosuspend_delay);
+        else
+            bbswitch_gov_disarm(bd);
+        break;
+    case GOV_EV_BIND:
+    case GOV_EV_HOLD:
+        bbswitch_gov_disarm(bd);
+        break;
+    case GOV_EV_TIMER:
+        if (READ_ONCE(bd->state) == CARD_ON && bbswitch_gov_idle(bd))
+            return CARD_OFF;
+        return CARD_UNCHANGED;
+    }
+    return bbswitch_gov_manual_event(bd, event, arg);
+}
+
+static void bbswitch_gov_autosuspend_start(struct bbswitch_dev *bd) {
+    bbswitch_gov_arm(bd, autosuspend_delay);
+}
+
+/* battery-aware: turns the card off whenever it is unused on battery */
+static int bbswitch_gov_battery_event(struct bbswitch_dev *bd, int event,
+    int arg) {
+    switch (event) {
+    case GOV_EV_POWER_SOURCE:
+        if (arg == POLICY_BATTERY && battery_state == CARD_UNCHANGED)
+            return CARD_OFF;
+        break;
+    case GOV_EV_UNBIND:
+    case GOV_EV_RELEASE:
+        if (READ_ONCE(policy_source) == POLICY_BATTERY)
+            return CARD_OFF;
+        break;
+    }
+    return bbswitch_gov_manual_event(bd, event, arg);
+}
+
+/* predictive: learns how long the card stays unused and only turns it off
+ * when that is expected to last longer than predictive_breakeven ms, the card
+ * is put in standby otherwise */
+static int bbswitch_gov_predictive_event(struct bbswitch_dev *bd, int event,
+    int arg) {
+    u32 sample, predicted;
+
+    switch (event) {
+    case GOV_EV_BIND:
+    case GOV_EV_HOLD:
+        if (bd->gov_idle_since) {
+            sample = ktime_ms_delta(ktime_get(), bd->gov_idle_since);
+            predicted = READ_ONCE(bd->gov_idle_ms);
+            // moving average with a weight of 1/4
+            WRITE_ONCE(bd->gov_idle_ms,
+                predicted ? (predicted * 3 + sample) / 4 : sample);
+            bd->gov_idle_since = 0;
+        }
+        break;
+    case GOV_EV_UNBIND:
+    case GOV_EV_RELEASE:
+        if (!bbswitch_gov_idle(bd))
+            return CARD_UNCHANGED;
+        bd->gov_idle_since = ktime_get();
+        predicted = READ_ONCE(bd->gov_idle_ms);
+        return predicted && predicted < predictive_breakeven ?
+            CARD_STANDBY : CARD_OFF;
+    }
+    return bbswitch_gov_manual_event(bd, event, arg);
+}
+
+static void bbswitch_gov_stop_timer(struct bbswitch_dev *bd) {
+    cancel_delayed_work_sync(&bd->gov_work);
+}
+
+static const struct bbswitch_governor bbswitch_governors[] = {
+    {
+        .name   = "manual",
+        .event  = bbswitch_gov_manual_event,
+    },
+    {
+        .name   = "autosuspend-timer",
+        .event  = bbswitch_gov_autosuspend_event,
+        .start  = bbswitch_gov_autosuspend_start,
+        .stop   = bbswitch_gov_stop_timer,
+    },
+    {
+        .name   = "battery-aware",
+        .event  = bbswitch_gov_battery_event,
+    },
+    {
+        .name   = "predictive",
+        .event  = bbswitch_gov_predictive_event,
+    },
+};
+
+static const struct bbswitch_governor *bbswitch_governor = &bbswitch_governors[0];
+// serialises governor changes against module unload
+static DEFINE_MUTEX(governor_lock);
+
+static int bbswitch_event_cause(int event) {
+    switch (event) {
+    case GOV_EV_USER:
+        return BBSWITCH_CAUSE_USER;
+    case GOV_EV_HOLD:
+    case GOV_EV_RELEASE:
+        return BBSWITCH_CAUSE_HOLD;
+    case GOV_EV_SUSPEND:
+    case GOV_EV_RESUME:
+        return BBSWITCH_CAUSE_PM;
+    case GOV_EV_INIT:
+        return BBSWITCH_CAUSE_INIT;
+    case GOV_EV_EXIT:
+        return BBSWITCH_CAUSE_EXIT;
+    case GOV_EV_POWER_SOURCE:
+        return BBSWITCH_CAUSE_POLICY;
+    case GOV_EV_RECONCILE:
+        return BBSWITCH_CAUSE_RECONCILE;
+    }
+    return BBSWITCH_CAUSE_GOVERNOR;
+}
+
+// Events that arrive from notifiers and timers. Their transitions are not
+// waited for and do not interrupt one that is running.
+static bool bbswitch_event_async(int event) {
+    return event >= GOV_EV_POWER_SOURCE;
+}
+
+// Asynchronous events that arrive during a transition are replayed when it is
+// done, the power source is evaluated again and the governor timer rearmed
+#define GOV_DEFER_POLICY    0
+#define GOV_DEFER_TIMER     1
+
+static void bbswitch_gov_defer(struct bbswitch_dev *bd, int event) {
+    if (event == GOV_EV_POWER_SOURCE)
+        set_bit(GOV_DEFER_POLICY, &bd->gov_deferred);
+    else if (event == GOV_EV_TIMER)
+        set_bit(GOV_DEFER_TIMER, &bd->gov_deferred);
+}
+
+// Passes an event to the governor and submits the transition it asks for.
+// Returns the sequence number to wait for, 0 if there is nothing to do or
+// -EAGAIN if the circuit breaker refuses ON. flags are BBSWITCH_SET_*.
+static s64 bbswitch_decide(struct bbswitch_dev *bd, int event, int arg,
+    unsigned int flags) {
+    const struct bbswitch_governor *gov = READ_ONCE(bbswitch_governor);
+    int target;
+
+    if (bbswitch_event_async(event)) {
+        if (READ_ONCE(bbswitch_exiting))
+            return 0;
+        if (READ_ONCE(bd->state) == CARD_TRANSITIONING) {
+            bbswitch_gov_defer(bd, event);
+            return 0;
+        }
+    }
+
+    target = gov->event(bd, event, arg);
+    if (target == CARD_UNCHANGED)
+        return 0;
+    // the governor may have chosen another state than the user
+    if (target != CARD_OFF)
+        flags &= ~BBSWITCH_SET_FORCE_UNBIND;
+    return bbswitch_submit(bd, target, bbswitch_event_cause(event), flags);
+}
+
+// bbswitch_decide() for synchronous events, waits for at most
+// transition_timeout ms. Returns the result of the transition, -ETIMEDOUT if
+// it is still running when the deadline expires or -EAGAIN if the circuit
+// breaker refuses ON.
+static int bbswitch_decide_wait(struct bbswitch_dev *bd, int event, int arg,
+    unsigned int flags) {
+    s64 seq = bbswitch_decide(bd, event, arg, flags);
+
+    if (seq <= 0)
+        return seq;
+    return bbswitch_wait_deadline(bd, seq);
+}
+
+static void bbswitch_gov_timer(struct work_struct *work) {
+    struct bbswitch_dev *bd = container_of(to_delayed_work(work),
+        struct bbswitch_dev, gov_work);
+
+    bbswitch_decide(bd, GOV_EV_TIMER, 0, 0);
+}
+
+static int governor_set(const char *val, const struct kernel_param *kp) {
+    const struct bbswitch_governor *gov = NULL, *old;
+    struct bbswitch_dev *bd;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bbswitch_governors); i++) {
+        if (sysfs_streq(val, bbswitch_governors[i].name))
+            gov = &bbswitch_governors[i];
+    }
+    if (!gov)
+        return -EINVAL;
+
+    mutex_lock(&governor_lock);
+    old = bbswitch_governor;
+    if (gov != old) {
+        list_for_each_entry(bd, &bbswitch_devices, list) {
+            if (bd->backend && old->stop)
+                old->stop(bd);
+        }
+        WRITE_ONCE(bbswitch_governor, gov);
+        list_for_each_entry(bd, &bbswitch_devices, list) {
+            if (bd->backend && gov->start)
+                gov->start(bd);
+        }
+        pr_info("using the %s governor\n", gov->name);
+    }
+    mutex_unlock(&governor_lock);
+    return 0;
+}
+
+static int governor_get(char *buffer, const struct kernel_param *kp) {
+    return scnprintf(buffer, PAGE_SIZE, "%s\n",
+        READ_ONCE(bbswitch_governor)->name);
+}
+
+static const struct kernel_param_ops governor_ops = {
+    .set = governor_set,
+    .get = governor_get,
+};
+module_param_cb(governor, &governor_ops, NULL, 0644);
+MODULE_PARM_DESC(governor, "Power governor: manual, autosuspend-timer, battery-aware or predictive (default = manual)");
+
+// Reports READY once a driver is bound, back to ON when it is unbound
+static void bbswitch_set_ready(struct bbswitch_dev *bd, bool ready) {
+    if (READ_ONCE(bd->ready) == ready)
+        return;
+    WRITE_ONCE(bd->ready, ready);
+    if (!READ_ONCE(autobind_enabled))
+        return;
+    atomic_inc(&bd->state_changes);
+    wake_up_all(&bd->transition_wq);
+    bbswitch_uevent(bd, READ_ONCE(bd->state), BBSWITCH_CAUSE_GOVERNOR, NULL);
+}
+
+// A driver_override of the previous autobind driver would keep the new one
+// from binding, so it is cleared. The card keeps its current driver.
+static int autobind_set(const char *val, const struct kernel_param *kp) {
+    char buf[sizeof(autobind)], *driver;
+    struct bbswitch_dev *bd;
+
+    if (strlen(val) >= sizeof(autobind))
+        return -ENOSPC;
+    // without the newline of echo, which would count as a driver
+    strscpy(buf, val, sizeof(buf));
+    driver = strim(buf);
+    spin_lock(&autobind_lock);
+    strscpy(autobind, driver, sizeof(autobind));
+    WRITE_ONCE(autobind_enabled, driver[0] != '\0');
+    spin_unlock(&autobind_lock);
+
+    mutex_lock(&governor_lock);
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        mutex_lock(&bd->lock);
+        bbswitch_clear_override(bd);
+        mutex_unlock(&bd->lock);
+    }
+    mutex_unlock(&governor_lock);
+    return 0;
+}
+
+static struct kparam_string autobind_string = {
+    .maxlen = sizeof(autobind),
+    .string = autobind,
+};
+
+static const struct kernel_param_ops autobind_ops = {
+    .set = autobind_set,
+    .get = param_get_string,
+};
+module_param_cb(autobind, &autobind_ops, &autobind_string, 0600);
+MODULE_PARM_DESC(autobind, "Driver to bind once the card is on, any for the first matching one; the card is then reported READY when a driver is bound (default = empty, left to userspace)");
+
+// Moves an enumerated card between ENUMERATED and DRIVER_BOUND
+static void bbswitch_stage_bound(struct bbswitch_dev *bd, bool bound) {
+    if (stage_enumerated(READ_ONCE(bd->stage)))
+        bbswitch_set_stage(bd, bound ? BBSWITCH_STAGE_DRIVER_BOUND :
+            BBSWITCH_STAGE_ENUMERATED);
+}
+
+// A driver that binds brings the card to D0 itself, so it has left standby.
+// The state is refreshed now unless a transition runs, which refreshes it when
+// it is done. Waiting for the lock could deadlock with FORCE-UNBIND.
+static void bbswitch_standby_left(struct bbswitch_dev *bd) {
+    WRITE_ONCE(bd->standby, false);
+    if (!mutex_trylock(&bd->lock))
+        return;
+    bbswitch_cache_state(bd);
+    mutex_unlock(&bd->lock);
+}
+
+// Driver binding events of the cards, from the PCI bus
+static int bbswitch_bus_handler(struct notifier_block *nbp,
+    unsigned long action, void *data) {
+    struct pci_dev *pdev = to_pci_dev(data);
+    struct bbswitch_dev *bd;
+    int event;
+
+    if (action == BUS_NOTIFY_BOUND_DRIVER)
+        event = GOV_EV_BIND;
+    else if (action == BUS_NOTIFY_UNBOUND_DRIVER)
+        event = GOV_EV_UNBIND;
+    else
+        return NOTIFY_DONE;
+
+    if (!completion_done(&bbswitch_setup_done))
+        return NOTIFY_DONE;
+
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        if (bd->backend && pci_domain_nr(pdev->bus) == bd->domain &&
+            pdev->bus->number == bd->bus && pdev->devfn == bd->devfn) {
+            bbswitch_set_ready(bd, event == GOV_EV_BIND);
+            if (event == GOV_EV_BIND)
+                bbswitch_standby_left(bd);
+            bbswitch_stage_bound(bd, event == GOV_EV_BIND);
+            bbswitch_decide(bd, event, 0, 0);
+        }
+    }
+    return NOTIFY_OK;
+}
+
+static struct notifier_block bus_nb = {
+    .notifier_call = bbswitch_bus_handler,
+};
+
+static ssize_t bbswitch_proc_write(struct file *fp, const char __user *buff,
+    size_t len, loff_t *off) {
+    struct bbswitch_dev *bd = pde_data(file_inode(fp));
+    char cmd[24];
+    int ret = 0;
+
+    if (len >= sizeof(cmd))
+        len = sizeof(cmd) - 1;
+
+    if (copy_from_user(cmd, buff, len))
+        return -EFAULT;
+
+    if (wait_for_completion_interruptible(&bbswitch_setup_done))
+        return -ERESTARTSYS;
+    if (!bd->backend)
+        return -ENODEV;
+
+    if (strncmp(cmd, "OFF FORCE-UNBIND", 16) == 0)
+        ret = bbswitch_decide_wait(bd, GOV_EV_USER, CARD_OFF,
+            BBSWITCH_SET_FORCE_UNBIND);
+    else if (strncmp(cmd, "OFF", 3) == 0)
+        ret = bbswitch_decide_wait(bd, GOV_EV_USER, CARD_OFF, 0);
+
+    if (strncmp(cmd, "ON", 2) == 0)
+        ret = bbswitch_decide_wait(bd, GOV_EV_USER, CARD_ON, 0);
+
+    if (strncmp(cmd, "STANDBY", 7) == 0)
+        ret = bbswitch_decide_wait(bd, GOV_EV_USER, CARD_STANDBY, 0);
+
+    if (strncmp(cmd, "RESET", 5) == 0)
+        bbswitch_breaker_reset(bd);
+
+    return ret ? ret : len;
+}
+
+static int bbswitch_proc_show(struct seq_file *seqfp, void *p) {
+    struct bbswitch_dev *bd = seqfp->private;
+    int state = READ_ONCE(bd->state);
+    bool hardware = false;
+
+    // Status reads are answered from the state cached by the last
+    // transition so that monitoring does not resume the root port. Only
+    // query the firmware when nothing is known yet or when explicitly
+    // requested, and never wait for a transition in progress.
+    if ((state == CARD_UNCHANGED || status_probe) &&
+        mutex_trylock(&bd->lock)) {
+        if (bd->backend) {
+            state = bbswitch_cache_state(bd);
+            hardware = true;
+        }
+        mutex_unlock(&bd->lock);
+    }
+    metrics_status_read(bd, hardware);
+
+    // show the card state. Example output: 0000:01:00:00 ON
+    seq_printf(seqfp, "%s %s\n", bd->name,
+        bbswitch_state_name(bbswitch_reported_state(bd, state)));
+    return 0;
+}
+static int bbswitch_proc_open(struct inode *inode, struct file *file) {
+    return single_open(file, bbswitch_proc_show, pde_data(inode));
+}
+
+// Takes a hold on the card for this file descriptor and powers it on.
+// Returns 0 on success or a negative error code otherwise.
+static int bbswitch_hold(struct bbswitch_file *bf) {
+    struct bbswitch_dev *bd = bf->bd;
+    int ret;
+
+    if (wait_for_completion_interruptible(&bbswitch_setup_done))
+        return -ERESTARTSYS;
+    if (!bd->backend)
+        return -ENODEV;
+
+    // count the hold first so that no OFF request can sneak in
+    mutex_lock(&bd->lock);
+    if (bf->held) {
+        mutex_unlock(&bd->lock);
+        return 0;
+    }
+    bf->held = true;
+    if (bd->hold_count++ == 0) {
+        bd->hold_restore = READ_ONCE(bd->state);
+        if (bd->hold_restore != CARD_ON && bd->hold_restore != CARD_STANDBY)
+            bd->hold_restore = CARD_OFF;
+    }
+    mutex_unlock(&bd->lock);
+
+    ret = bbswitch_decide_wait(bd, GOV_EV_HOLD, CARD_ON, 0);
+    if (!ret && READ_ONCE(bd->state) != CARD_ON) {
+        pr_warn("could not enable %s for hold\n", bd->name);
+        ret = -EIO;
+    }
+
+    mutex_lock(&bd->lock);
+    if (ret) {
+        bf->held = false;
+        bd->hold_count--;
+    }
+    pr_debug("%s: hold %s, %u holder(s)\n", bd->name,
+        ret ? "failed" : "taken", bd->hold_count);
+    mutex_unlock(&bd->lock);
+    return ret;
+}
+
+// Drops the hold of this file descriptor. The last one puts the card back in
+// the state it had before the first hold, the usual refusal applies if a
+// driver is still bound.
+static void bbswitch_release_hold(struct bbswitch_file *bf) {
+    struct bbswitch_dev *bd = bf->bd;
+    int restore = CARD_OFF;
+    bool last = false;
+
+    mutex_lock(&bd->lock);
+    if (bf->held) {
+        bf->held = false;
+        bd->hold_count--;
+        last = bd->hold_count == 0;
+        restore = bd->hold_restore;
+        pr_debug("%s: hold released, %u holder(s)\n", bd->name,
+            bd->hold_count);
+    }
+    mutex_unlock(&bd->lock);
+
+    if (last)
+        bbswitch_decide_wait(bd, GOV_EV_RELEASE, restore, 0);
+}
+
+static int bbswitch_dev_open(struct inode *inode, struct file *file) {
+    // misc_open() points private_data to our miscdevice
+    struct miscdevice *misc = file->private_data;
+    struct bbswitch_file *bf;
+
+    bf = kzalloc(sizeof(*bf), GFP_KERNEL);
+    if (!bf)
+        return -ENOMEM;
+
+    bf->bd = container_of(misc, struct bbswitch_dev, misc);
+    bf->seen_changes = atomic_read(&bf->bd->state_changes);
+    file->private_data = bf;
+    return 0;
+}
+
+static int bbswitch_dev_release(struct inode *inode, struct file *file) {
+    struct bbswitch_file *bf = file->private_data;
+
+    // also reached when the holder exits or crashes without releasing
+    bbswitch_release_hold(bf);
+    kfree(bf);
+    return 0;
+}
+
+static int bbswitch_get_status(struct bbswitch_file *bf,
+    struct bbswitch_status __user *arg) {
+    struct bbswitch_dev *bd = bf->bd;
+    struct bbswitch_status st = {};
+
+    // read the counter first so a change racing with the copy is reported
+    st.changes = atomic_read(&bd->state_changes);
+    strscpy(st.name, bd->name, sizeof(st.name));
+    if (completion_done(&bbswitch_setup_done) && bd->backend)
+        strscpy(st.backend, bd->backend->name, sizeof(st.backend));
+    st.state = bbswitch_reported_state(bd, READ_ONCE(bd->state));
+    st.hold_count = READ_ONCE(bd->hold_count);
+    spin_lock(&bd->req_lock);
+    st.on_failures = bd->on_failures;
+    st.breaker_open = bd->breaker_open;
+    spin_unlock(&bd->req_lock);
+    st.stuck_transitions = atomic_read(&bd->stuck_transitions);
+    st.on_latency_us = READ_ONCE(on_latency_us);
+    st.stage = READ_ONCE(bd->stage);
+    metrics_status_read(bd, false);
+
+    if (copy_to_user(arg, &st, sizeof(st)))
+        return -EFAULT;
+    bf->seen_changes = st.changes;
+    return 0;
+}
+
+static int bbswitch_set(struct bbswitch_file *bf,
+    struct bbswitch_set __user *arg) {
+    struct bbswitch_dev *bd = bf->bd;
+    struct bbswitch_set set;
+    unsigned int flags;
+    s64 seq;
+
+    // the node is group-writable so that its group can take holds,
+    // switching needs CAP_SYS_ADMIN like writing /proc/acpi/bbswitch
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (copy_from_user(&set, arg, sizeof(set)))
+        return -EFAULT;
+    if (set.state != CARD_OFF && set.state != CARD_ON &&
+        set.state != CARD_STANDBY)
+        return -EINVAL;
+    if (set.flags & ~(BBSWITCH_SET_NOWAIT | BBSWITCH_SET_FORCE_UNBIND))
+        return -EINVAL;
+    if ((set.flags & BBSWITCH_SET_FORCE_UNBIND) && set.state != CARD_OFF)
+        return -EINVAL;
+
+    if (wait_for_completion_interruptible(&bbswitch_setup_done))
+        return -ERESTARTSYS;
+    if (!bd->backend)
+        return -ENODEV;
+
+    flags = set.flags & BBSWITCH_SET_FORCE_UNBIND;
+    if (!(set.flags & BBSWITCH_SET_NOWAIT) && !set.timeout_ms)
+        return bbswitch_decide_wait(bd, GOV_EV_USER, set.state, flags);
+
+    seq = bbswitch_decide(bd, GOV_EV_USER, set.state, flags);
+    if (seq <= 0 || (set.flags & BBSWITCH_SET_NOWAIT))
+        return seq < 0 ? seq : 0;
+    // a caller's own deadline does not mark the card as stuck
+    return bbswitch_wait_request(bd, seq, set.timeout_ms);
+}
+
+static long bbswitch_dev_ioctl(struct file *file, unsigned int cmd,
+    unsigned long arg) {
+    struct bbswitch_file *bf = file->private_data;
+
+    switch (cmd) {
+    case BBSWITCH_IOC_HOLD:
+        // holds keep OFF from working, only writers of the node may take them
+        if (!(file->f_mode & FMODE_WRITE) && !capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        return bbswitch_hold(bf);
+    case BBSWITCH_IOC_RELEASE:
+        bbswitch_release_hold(bf);
+        return 0;
+    case BBSWITCH_IOC_STATUS:
+        return bbswitch_get_status(bf, (void __user *)arg);
+    case BBSWITCH_IOC_SET:
+        return bbswitch_set(bf, (void __user *)arg);
+    }
+    return -ENOTTY;
+}
+
+// Readable once the state changed since the last BBSWITCH_IOC_STATUS
+static __poll_t bbswitch_dev_poll(struct file *file, poll_table *wait) {
+    struct bbswitch_file *bf = file->private_data;
+
+    poll_wait(file, &bf->bd->transition_wq, wait);
+    if (atomic_read(&bf->bd->state_changes) != bf->seen_changes)
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+/*
+ * Power source changes, passed to the governor. Power supply notifications
+ * arrive in atomic context, so the source is evaluated in a work item. Both
+ * work items are freezable so that they do not run during suspend. Battery
+ * is only reported after battery_delay seconds.
+ */
+static atomic_t policy_force = ATOMIC_INIT(0);
+
+static void bbswitch_policy_apply(struct work_struct *work) {
+    struct bbswitch_dev *bd;
+    int source = READ_ONCE(policy_source);
+
+    wait_for_completion(&bbswitch_setup_done);
+    pr_debug("running on %s\n", source == POLICY_AC ? "AC" : "battery");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        if (bd->backend)
+            bbswitch_decide(bd, GOV_EV_POWER_SOURCE, source, 0);
+    }
+}
+static DECLARE_DELAYED_WORK(policy_apply_work, bbswitch_policy_apply);
+
+static void bbswitch_policy_eval(struct work_struct *work) {
+    int supplied = power_supply_is_system_supplied();
+    unsigned long delay = 0;
+    int source;
+
+    // machines without a battery report no supplies at all
+    source = supplied > 0 || supplied == -ENODEV ? POLICY_AC : POLICY_BATTERY;
+    if (source == policy_source && !atomic_xchg(&policy_force, 0))
+        return;
+    WRITE_ONCE(policy_source, source);
+
+    cancel_delayed_work(&policy_apply_work);
+    if (source == POLICY_BATTERY)
+        delay = msecs_to_jiffies(battery_delay * MSEC_PER_SEC);
+    queue_delayed_work(system_freezable_wq, &policy_apply_work, delay);
+}
+static DECLARE_WORK(policy_eval_work, bbswitch_policy_eval);
+
+// Re-evaluates the power source. With force the governor is told about it
+// even if the source did not change.
+static void bbswitch_policy_kick(bool force) {
+    if (force)
+        atomic_set(&policy_force, 1);
+    queue_work(system_freezable_wq, &policy_eval_work);
+}
+
+static void bbswitch_gov_replay(struct bbswitch_dev *bd) {
+    if (READ_ONCE(bbswitch_exiting))
+        return;
+    if (test_and_clear_bit(GOV_DEFER_POLICY, &bd->gov_deferred))
+        bbswitch_policy_kick(true);
+    // the card was just used, so it gets the full delay again
+    if (test_and_clear_bit(GOV_DEFER_TIMER, &bd->gov_deferred))
+        bbswitch_gov_arm(bd, autosuspend_delay);
+}
+
+static int bbswitch_psy_handler(struct notifier_block *nbp,
+    unsigned long event, void *data) {
+    if (event == PSY_EVENT_PROP_CHANGED)
+        bbswitch_policy_kick(false);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block psy_nb = {
+    .notifier_call = bbswitch_psy_handler,
+};
+
+/*
+ * Reconciler: every reconcile_interval seconds (plus up to 1/8 of jitter)
+ * compares the firmware power state, the presence of the card on the bus and
+ * the cached state. The timer is deferrable so it never wakes an idle CPU,
+ * and nothing is scheduled while the interval is 0.
+ */
+static bool reconcile_enabled;      /* protected by the module parameter lock */
+
+static void bbswitch_reconcile(struct work_struct *work);
+static DECLARE_DEFERRABLE_WORK(reconcile_work, bbswitch_reconcile);
+
+static void bbswitch_reconcile_schedule(void) {
+    unsigned long delay = msecs_to_jiffies(reconcile_interval * MSEC_PER_SEC);
+
+    if (!reconcile_enabled || !reconcile_interval)
+        return;
+    delay += get_random_u32() % (delay / 8 + 1);
+    mod_delayed_work(system_wq, &reconcile_work, delay);
+}
+
+// Rescans the bus of a card that the firmware reports as powered
+static void bbswitch_rescan(struct bbswitch_dev *bd) {
+    struct pci_bus *bus;
+
+    pci_lock_rescan_remove();
+    bus = pci_find_bus(bd->domain, bd->bus);
+    if (bus)
+        pci_rescan_bus(bus);
+    pci_unlock_rescan_remove();
+}
+
+static void bbswitch_reconcile_dev(struct bbswitch_dev *bd) {
+    int stage, cached;
+
+    // a transition is in progress, it will update the state itself
+    if (!mutex_trylock(&bd->lock))
+        return;
+    cached = READ_ONCE(bd->state);
+    stage = bbswitch_probe_stage(bd);
+    mutex_unlock(&bd->lock);
+
+    // nothing to compare with when either side is unknown
+    if (cached == CARD_TRANSITIONING || cached == CARD_TIMEOUT ||
+        cached == CARD_UNCHANGED || stage < 0)
+        return;
+
+    if (stage == BBSWITCH_STAGE_POWERING_ON ||
+        stage == BBSWITCH_STAGE_LINK_UP) {
+        // powered according to the firmware, but not on the bus
+        atomic_inc(&bd->mismatches);
+        pr_warn_ratelimited("%s: powered but missing from the bus\n",
+            bd->name);
+        if (!reconcile_repair)
+            return;
+        if (cached == CARD_OFF)
+            bbswitch_decide(bd, GOV_EV_RECONCILE, CARD_OFF, 0);
+        else
+            bbswitch_rescan(bd);
+    } else if ((stage == BBSWITCH_STAGE_OFF) != (cached == CARD_OFF)) {
+        atomic_inc(&bd->mismatches);
+        pr_warn_ratelimited("%s: firmware reports %s, expected %s\n",
+            bd->name, stage_names[stage], bbswitch_state_name(cached));
+        if (!reconcile_repair)
+            return;
+        // turn an unexpectedly powered card off again, but never power one
+        // on behind the user's back
+        if (cached == CARD_OFF)
+            bbswitch_decide(bd, GOV_EV_RECONCILE, CARD_OFF, 0);
+        else if (mutex_trylock(&bd->lock)) {
+            bbswitch_cache_state(bd);
+            mutex_unlock(&bd->lock);
+        }
+    }
+}
+
+static void bbswitch_reconcile(struct work_struct *work) {
+    struct bbswitch_dev *bd;
+
+    if (completion_done(&bbswitch_setup_done)) {
+        list_for_each_entry(bd, &bbswitch_devices, list) {
+            if (bd->backend)
+                bbswitch_reconcile_dev(bd);
+        }
+    }
+
+    kernel_param_lock(THIS_MODULE);
+    bbswitch_reconcile_schedule();
+    kernel_param_unlock(THIS_MODULE);
+}
+
+static void bbswitch_reconcile_stop(void) {
+    kernel_param_lock(THIS_MODULE);
+    reconcile_enabled = false;
+    kernel_param_unlock(THIS_MODULE);
+    cancel_delayed_work_sync(&reconcile_work);
+}
+
+static int reconcile_interval_set(const char *val,
+    const struct kernel_param *kp) {
+    int ret = param_set_uint(val, kp);
+
+    if (ret == 0 && reconcile_enabled) {
+        if (reconcile_interval)
+            bbswitch_reconcile_schedule();
+        else
+            cancel_delayed_work(&reconcile_work);
+    }
+    return ret;
+}
+
+static const struct kernel_param_ops reconcile_interval_ops = {
+    .set = reconcile_interval_set,
+    .get = param_get_uint,
+};
+module_param_cb(reconcile_interval, &reconcile_interval_ops,
+    &reconcile_interval, 0644);
+MODULE_PARM_DESC(reconcile_interval, "Seconds between checks that the firmware, the bus and the reported state agree, 0 to disable (default = 0)");
+
+static int bbswitch_pm_handler(struct notifier_block *nbp,
+    unsigned long event_type, void *p) {
+    struct bbswitch_dev *bd;
+
+    // do not race with the initial state being applied
+    wait_for_completion(&bbswitch_setup_done);
+
+    switch (event_type) {
+    case PM_HIBERNATION_PREPARE:
+    case PM_SUSPEND_PREPARE:
+        pr_debug("Detected suspend");
+        list_for_each_entry(bd, &bbswitch_devices, list) {
+            if (!bd->backend)
+                continue;
+            bd->before_suspend_state = READ_ONCE(bd->state);
+            bbswitch_uevent(bd, bd->before_suspend_state, BBSWITCH_CAUSE_PM,
+                "suspend");
+            // enable the device before suspend to avoid the PCI config space
+            // from being saved incorrectly
+            if (bd->before_suspend_state == CARD_OFF ||
+                bd->before_suspend_state == CARD_STANDBY)
+                pr_info("Enabling GPU %s for suspend", bd->name);
+            bbswitch_decide_wait(bd, GOV_EV_SUSPEND, CARD_ON, 0);
+        }
+        break;
+    case PM_POST_HIBERNATION:
+    case PM_POST_SUSPEND:
+    case PM_POST_RESTORE:
+        pr_debug("Detected restore");
+        // after suspend, the card is on, but if it was off or in standby
+        // before suspend, the governor normally puts it back
+        list_for_each_entry(bd, &bbswitch_devices, list) {
+            if (!bd->backend)
+                continue;
+            if (bd->before_suspend_state == CARD_OFF ||
+                bd->before_suspend_state == CARD_STANDBY)
+                pr_info("Restoring GPU %s to %s", bd->name,
+                    bbswitch_state_name(bd->before_suspend_state));
+            bbswitch_decide_wait(bd, GOV_EV_RESUME, bd->before_suspend_state,
+                0);
+            bbswitch_uevent(bd, READ_ONCE(bd->state), BBSWITCH_CAUSE_PM,
+                "resume");
+        }
+        // the power source may have changed while suspended
+        bbswitch_policy_kick(true);
+        break;
+    case PM_RESTORE_PREPARE:
+        // deliberately don't do anything as it does not occur before suspend
+        // nor hibernate, but before restoring a saved image. In that case,
+        // either PM_POST_HIBERNATION or PM_POST_RESTORE will be called
+        break;
+    }
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static struct proc_ops bbswitch_fops = {
+    .proc_open   = bbswitch_proc_open,
+    .proc_read   = seq_read,
     .proc_write  = bbswitch_proc_write,
     .proc_lseek  = seq_lseek,
     .proc_release= single_release
@@ -436,132 +2973,880 @@ static struct file_operations bbswitch_fops = {
 };
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+#ifdef CONFIG_COMPAT
+// every ioctl takes a pointer, which only has to be widened for 32-bit callers
+static long compat_ptr_ioctl(struct file *file, unsigned int cmd,
+    unsigned long arg) {
+    return file->f_op->unlocked_ioctl(file, cmd,
+        (unsigned long)compat_ptr(arg));
+}
+#else
+#define compat_ptr_ioctl NULL
+#endif
+#endif
+
+static const struct file_operations bbswitch_dev_fops = {
+    .owner          = THIS_MODULE,
+    .open           = bbswitch_dev_open,
+    .release        = bbswitch_dev_release,
+    .unlocked_ioctl = bbswitch_dev_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .poll           = bbswitch_dev_poll,
+    .llseek         = noop_llseek,
+};
+
 static struct notifier_block nb = {
     .notifier_call = &bbswitch_pm_handler
 };
 
-static int __init bbswitch_init(void) {
-    struct proc_dir_entry *acpi_entry;
-    struct pci_dev *pdev = NULL;
-    acpi_handle igd_handle = NULL;
+// Catches up with a power change made by the vga_switcheroo handler, which
+// cannot wait for bd->lock: drops the reference to a card that went off the
+// bus and refreshes the cached state
+static void bbswitch_switcheroo_work(struct work_struct *work) {
+    struct bbswitch_dev *bd = container_of(work, struct bbswitch_dev,
+        switcheroo_work);
+    int state;
+
+    mutex_lock(&bd->lock);
+    if (bd->backend->removes_device &&
+        bbswitch_probe_stage(bd) == BBSWITCH_STAGE_OFF)
+        put_dis_dev(bd);
+    state = bbswitch_cache_state(bd);
+    mutex_unlock(&bd->lock);
+    bbswitch_uevent(bd, state, BBSWITCH_CAUSE_SWITCHEROO, NULL);
+}
 
-    pr_info("version %s\n", BBSWITCH_VERSION);
+// Allocates the context of a card, shared by real and simulated cards
+static struct bbswitch_dev *bbswitch_alloc_dev(void) {
+    struct bbswitch_dev *bd;
+
+    bd = kzalloc(sizeof(*bd), GFP_KERNEL);
+    if (!bd)
+        return NULL;
+
+    mutex_init(&bd->lock);
+    mutex_init(&bd->power_lock);
+    spin_lock_init(&bd->req_lock);
+    INIT_WORK(&bd->transition_work, bbswitch_transition_work);
+    INIT_WORK(&bd->bind_work, bbswitch_bind_work);
+    INIT_WORK(&bd->switcheroo_work, bbswitch_switcheroo_work);
+    INIT_DELAYED_WORK(&bd->gov_work, bbswitch_gov_timer);
+    init_waitqueue_head(&bd->transition_wq);
+    bd->state = CARD_TRANSITIONING;
+    bd->state_since = ktime_get();
+    bd->stage_since = bd->state_since;
+    return bd;
+}
 
-    while ((pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev)) != NULL) {
-        struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
-        acpi_handle handle;
-        int pci_class = pdev->class >> 8;
+static struct bbswitch_dev *bbswitch_add_dev(struct pci_dev *pdev,
+    acpi_handle handle) {
+    struct bbswitch_dev *bd;
+
+    bd = bbswitch_alloc_dev();
+    if (!bd)
+        return NULL;
+
+    bd->pdev = pci_dev_get(pdev);
+    bd->handle = handle;
+    bd->domain = pci_domain_nr(pdev->bus);
+    bd->bus = pdev->bus->number;
+    bd->devfn = pdev->devfn;
+    strscpy(bd->name, dev_name(&pdev->dev), sizeof(bd->name));
+    list_add_tail(&bd->list, &bbswitch_devices);
+    return bd;
+}
 
-        if (pci_class != PCI_CLASS_DISPLAY_VGA &&
-            pci_class != PCI_CLASS_DISPLAY_3D)
-            continue;
+static void bbswitch_free_dev(struct bbswitch_dev *bd) {
+    cancel_work_sync(&bd->transition_work);
+    cancel_delayed_work_sync(&bd->gov_work);
+    cancel_work_sync(&bd->bind_work);
+    cancel_work_sync(&bd->switcheroo_work);
+    // the override would keep pinning the card to that driver
+    bbswitch_clear_override(bd);
+    list_del(&bd->list);
+    put_dis_dev(bd);
+    mutex_destroy(&bd->power_lock);
+    mutex_destroy(&bd->lock);
+    kfree(bd);
+}
 
-        handle = ACPI_HANDLE(&pdev->dev);
+// Simulated cards of the sim backend start powered on, like a real card at
+// boot
+static struct bbswitch_dev *bbswitch_add_sim_dev(int index) {
+    struct bbswitch_dev *bd;
+
+    bd = bbswitch_alloc_dev();
+    if (!bd)
+        return NULL;
+
+    bd->index = index;
+    // no PCI domain is negative, so the bus lookups and the bus notifier never
+    // mistake a real device, such as the host bridge at 0000:00:00.0, for it
+    bd->domain = -1;
+    bd->sim_powered = true;
+    snprintf(bd->name, sizeof(bd->name), "sim%d", index);
+    list_add_tail(&bd->list, &bbswitch_devices);
+    return bd;
+}
 
-        if (!handle) {
-            pr_warn("cannot find ACPI handle for VGA device %s\n",
-                dev_name(&pdev->dev));
-            continue;
+// The current stage, then when each stage of the last transition was reached
+// relative to its start
+static int stages_show(struct seq_file *seqfp, void *p) {
+    struct bbswitch_dev *bd = seqfp->private;
+    ktime_t times[BBSWITCH_STAGES], start;
+    int i, stage;
+
+    spin_lock(&bd->req_lock);
+    stage = bd->stage;
+    memcpy(times, bd->stage_time, sizeof(times));
+    spin_unlock(&bd->req_lock);
+
+    start = times[BBSWITCH_STAGE_POWERING_ON] ? :
+        times[BBSWITCH_STAGE_POWERING_OFF] ? : times[stage];
+    seq_printf(seqfp, "stage %s\n", stage_names[stage]);
+    for (i = 0; i < BBSWITCH_STAGES; i++) {
+        if (times[i])
+            seq_printf(seqfp, "%-12s %lld us\n", stage_names[i],
+                ktime_us_delta(times[i], start));
+        else
+            seq_printf(seqfp, "%-12s -\n", stage_names[i]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stages);
+
+// Creates /proc/acpi/bbswitch and /dev/bbswitch for the first card and
+// bbswitchN for the following ones
+static int bbswitch_register_dev(struct bbswitch_dev *bd) {
+    if (bd->index == 0)
+        strscpy(bd->node_name, "bbswitch", sizeof(bd->node_name));
+    else
+        snprintf(bd->node_name, sizeof(bd->node_name), "bbswitch%d", bd->index);
+
+    bd->proc_entry = proc_create_data(bd->node_name, 0664, acpi_root_dir,
+        &bbswitch_fops, bd);
+    if (bd->proc_entry == NULL) {
+        pr_err("Couldn't create proc entry %s\n", bd->node_name);
+        return -ENOMEM;
+    }
+
+    bd->misc.minor = MISC_DYNAMIC_MINOR;
+    bd->misc.name = bd->node_name;
+    bd->misc.fops = &bbswitch_dev_fops;
+    // anyone may read the status, holds need write access
+    bd->misc.mode = 0664;
+    if (misc_register(&bd->misc)) {
+        pr_err("Couldn't register /dev/%s\n", bd->node_name);
+        proc_remove(bd->proc_entry);
+        bd->proc_entry = NULL;
+        return -ENOMEM;
+    }
+
+    bd->debugfs = debugfs_create_dir(bd->name, bbswitch_debugfs);
+    debugfs_create_atomic_t("stuck_transitions", 0444, bd->debugfs,
+        &bd->stuck_transitions);
+    debugfs_create_u32("on_failures", 0444, bd->debugfs, &bd->on_failures);
+    debugfs_create_u32("predicted_idle_ms", 0444, bd->debugfs,
+        &bd->gov_idle_ms);
+    debugfs_create_atomic_t("mismatches", 0444, bd->debugfs,
+        &bd->mismatches);
+    debugfs_create_file("stages", 0444, bd->debugfs, bd, &stages_fops);
+    return 0;
+}
+
+static void bbswitch_unregister_dev(struct bbswitch_dev *bd) {
+    if (bd->proc_entry) {
+        proc_remove(bd->proc_entry);
+        misc_deregister(&bd->misc);
+        bd->proc_entry = NULL;
+    }
+}
+
+static int init_timings_show(struct seq_file *seqfp, void *p) {
+    struct acpi_buffer buf;
+    int i;
+
+    for (i = 0; i < INIT_PHASES; i++)
+        seq_printf(seqfp, "%-12s %lld us\n", init_phase_names[i],
+            init_phase_us[i]);
+
+    for (i = 0; i < dsm_mask_count; i++) {
+        buf.length = ACPI_ALLOCATE_BUFFER;
+        buf.pointer = NULL;
+        acpi_get_name(dsm_masks[i].handle, ACPI_FULL_PATHNAME, &buf);
+        if (dsm_masks[i].probe_us < 0)
+            seq_printf(seqfp, "dsm %s %c cached\n", (char *)buf.pointer,
+                dsm_masks[i].muid == acpi_optimus_dsm_muid ? 'o' : 'n');
+        else
+            seq_printf(seqfp, "dsm %s %c %lld us\n", (char *)buf.pointer,
+                dsm_masks[i].muid == acpi_optimus_dsm_muid ? 'o' : 'n',
+                dsm_masks[i].probe_us);
+        kfree(buf.pointer);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(init_timings);
+
+static int on_latency_show(struct seq_file *seqfp, void *p) {
+    seq_printf(seqfp, "average_us %u\n", READ_ONCE(on_latency_us));
+    seq_printf(seqfp, "p90_us %u\n", on_latency_p90());
+    seq_printf(seqfp, "samples %u\n", READ_ONCE(on_latency_count));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(on_latency);
+
+static const char *journal_command_name(int command) {
+    switch (command) {
+    case BBSWITCH_JOURNAL_OFF:
+        return "OFF";
+    case BBSWITCH_JOURNAL_ON:
+        return "ON";
+    case BBSWITCH_JOURNAL_STANDBY:
+        return "STANDBY";
+    }
+    return "AML";
+}
+
+static int journal_show(struct seq_file *seqfp, void *p) {
+    struct bbswitch_journal_entry *entries;
+    unsigned int i, n;
+
+    if (!journal)
+        return 0;
+
+    entries = kvcalloc(journal_mask + 1, sizeof(*entries), GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    // seq ts_us device cause pid comm command method status duration state
+    n = journal_snapshot(entries);
+    for (i = 0; i < n; i++) {
+        struct bbswitch_journal_entry *e = &entries[i];
+
+        seq_printf(seqfp, "%llu %llu.%06llu %s %s %d %s %s %s %d %uus %s\n",
+            e->seq, e->timestamp_ns / NSEC_PER_SEC,
+            (e->timestamp_ns % NSEC_PER_SEC) / NSEC_PER_USEC,
+            e->device[0] ? e->device : "-",
+            e->cause < ARRAY_SIZE(journal_causes) ? journal_causes[e->cause] : "?",
+            e->pid, e->comm[0] ? e->comm : "-",
+            journal_command_name(e->command), e->method, e->status,
+            e->duration_us, e->state < 0 ? "-" : bbswitch_state_name(e->state));
+    }
+    kvfree(entries);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(journal);
+
+struct journal_bin {
+    size_t size;
+    struct bbswitch_journal_entry entries[];
+};
+
+static int journal_bin_open(struct inode *inode, struct file *file) {
+    struct journal_bin *jb;
+
+    if (!journal)
+        return -ENODEV;
+
+    jb = kvzalloc(sizeof(*jb) + (journal_mask + 1) * sizeof(jb->entries[0]),
+        GFP_KERNEL);
+    if (!jb)
+        return -ENOMEM;
+
+    jb->size = journal_snapshot(jb->entries) * sizeof(jb->entries[0]);
+    file->private_data = jb;
+    return 0;
+}
+
+static ssize_t journal_bin_read(struct file *file, char __user *buf,
+    size_t count, loff_t *ppos) {
+    struct journal_bin *jb = file->private_data;
+
+    return simple_read_from_buffer(buf, count, ppos, jb->entries, jb->size);
+}
+
+static int journal_bin_release(struct inode *inode, struct file *file) {
+    kvfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations journal_bin_fops = {
+    .owner   = THIS_MODULE,
+    .open    = journal_bin_open,
+    .read    = journal_bin_read,
+    .release = journal_bin_release,
+    .llseek  = default_llseek,
+};
+
+static void metrics_seconds(struct seq_file *seqfp, u64 us) {
+    u32 rem;
+    u64 secs = div_u64_rem(us, USEC_PER_SEC, &rem);
+
+    seq_printf(seqfp, "%llu.%06u\n", secs, rem);
+}
+
+static int metrics_show(struct seq_file *seqfp, void *p) {
+    struct bbswitch_dev *bd;
+    struct aml_latency lat;
+    u64 count, cumulative;
+    int i, j, state;
+    ktime_t now;
+
+    // cards are still being added until setup is done
+    if (!completion_done(&bbswitch_setup_done))
+        goto aml;
+
+    // a gauge rather than a stateset so the classic text parser accepts it
+    seq_puts(seqfp, "# TYPE bbswitch_state gauge\n"
+        "# HELP bbswitch_state 1 for the current state of the card.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        state = READ_ONCE(bd->state);
+        for (i = 0; i < CARD_STATES; i++)
+            seq_printf(seqfp, "bbswitch_state{card=\"%s\",state=\"%s\"} %d\n",
+                bd->name, metrics_states[i], i == state);
+    }
+
+    seq_puts(seqfp, "# TYPE bbswitch_state_seconds counter\n"
+        "# HELP bbswitch_state_seconds Time spent in each state.\n"
+        "# UNIT bbswitch_state_seconds seconds\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (i = 0; i < CARD_STATES; i++) {
+            spin_lock(&metrics_lock);
+            now = ktime_get();
+            count = bd->state_ns[i];
+            if (i == READ_ONCE(bd->state))
+                count += ktime_to_ns(ktime_sub(now, bd->state_since));
+            spin_unlock(&metrics_lock);
+            seq_printf(seqfp, "bbswitch_state_seconds_total{card=\"%s\",state=\"%s\"} ",
+                bd->name, metrics_states[i]);
+            metrics_seconds(seqfp, div_u64(count, NSEC_PER_USEC));
         }
+    }
 
-        acpi_get_name(handle, ACPI_FULL_PATHNAME, &buf);
+    seq_puts(seqfp, "# TYPE bbswitch_stage gauge\n"
+        "# HELP bbswitch_stage 1 for the current stage of the card.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        state = READ_ONCE(bd->stage);
+        for (i = 0; i < BBSWITCH_STAGES; i++)
+            seq_printf(seqfp, "bbswitch_stage{card=\"%s\",stage=\"%s\"} %d\n",
+                bd->name, stage_names[i], i == state);
+    }
 
-        if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
-            igd_handle = handle;
-            pr_info("Found integrated VGA device %s: %s\n",
-                dev_name(&pdev->dev), (char *)buf.pointer);
-        } else {
-            if(handle && handle_has_dsm_func(handle,acpi_optimus_dsm_muid, 0x100, 0x1A)){
-                dis_dev = pdev;
-                strlcpy(dis_dev_name, dev_name(&pdev->dev), sizeof(dis_dev_name));
-                dis_handle = handle;
-                vendor = pdev->vendor;
-                device = pdev->device;
-                pr_info("Found discrete VGA device %s: %s\n",
-                    dis_dev_name, (char *)buf.pointer);
-            }else{
-                igd_handle = handle;
-                pr_info("Found non-intel integrated VGA device %s: %s\n",
-                    dev_name(&pdev->dev), (char *)buf.pointer);
+    seq_puts(seqfp, "# TYPE bbswitch_stage_seconds counter\n"
+        "# HELP bbswitch_stage_seconds Time spent in each stage.\n"
+        "# UNIT bbswitch_stage_seconds seconds\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (i = 0; i < BBSWITCH_STAGES; i++) {
+            spin_lock(&bd->req_lock);
+            count = bd->stage_ns[i];
+            if (i == bd->stage)
+                count += ktime_to_ns(ktime_sub(ktime_get(), bd->stage_since));
+            spin_unlock(&bd->req_lock);
+            seq_printf(seqfp, "bbswitch_stage_seconds_total{card=\"%s\",stage=\"%s\"} ",
+                bd->name, stage_names[i]);
+            metrics_seconds(seqfp, div_u64(count, NSEC_PER_USEC));
+        }
+    }
+
+    seq_puts(seqfp, "# TYPE bbswitch_transitions counter\n"
+        "# HELP bbswitch_transitions Transitions run, by cause and command.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (i = 0; i < BBSWITCH_CAUSES; i++) {
+            for (j = 0; j < BBSWITCH_COMMANDS; j++) {
+                if (!metrics_commands[j] || i == BBSWITCH_CAUSE_AML)
+                    continue;
+                spin_lock(&metrics_lock);
+                count = bd->transitions[i][j];
+                spin_unlock(&metrics_lock);
+                seq_printf(seqfp, "bbswitch_transitions_total{card=\"%s\",cause=\"%s\",command=\"%s\"} %llu\n",
+                    bd->name, journal_causes[i], metrics_commands[j], count);
             }
         }
-        kfree(buf.pointer);
     }
 
-    if (dis_dev == NULL) {
-        pr_err("No discrete VGA device found\n");
-        return -ENODEV;
+    seq_puts(seqfp, "# TYPE bbswitch_refusals counter\n"
+        "# HELP bbswitch_refusals Transitions refused because the card was in use or the circuit breaker was open.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (i = 0; i < METRICS_REFUSALS; i++) {
+            for (j = 0; j < BBSWITCH_COMMANDS; j++) {
+                if (!metrics_commands[j])
+                    continue;
+                spin_lock(&metrics_lock);
+                count = bd->refusals[i][j];
+                spin_unlock(&metrics_lock);
+                seq_printf(seqfp, "bbswitch_refusals_total{card=\"%s\",reason=\"%s\",command=\"%s\"} %llu\n",
+                    bd->name, metrics_refusals[i], metrics_commands[j], count);
+            }
+        }
     }
 
-    if (!skip_optimus_dsm &&
-            has_dsm_func(acpi_optimus_dsm_muid, 0x100, 0x1A)) {
-        dsm_type = DSM_TYPE_OPTIMUS;
-        pr_info("detected an Optimus _DSM function\n");
-    } else if (has_dsm_func(acpi_nvidia_dsm_muid, 0x102, 0x3)) {
-        dsm_type = DSM_TYPE_NVIDIA;
-        pr_info("detected a nVidia _DSM function\n");
-    } else {
-       /* At least two Acer machines are known to use the intel ACPI handle
-        * with the legacy nvidia DSM */
-        dis_handle = igd_handle;
-        if (dis_handle && has_dsm_func(acpi_nvidia_dsm_muid, 0x102, 0x3)) {
-            dsm_type = DSM_TYPE_NVIDIA;
-            pr_info("detected a nVidia _DSM function on the"
-                " integrated video card\n");
-
-        } else {
-            pr_err("No suitable _DSM call found.\n");
-            return -ENODEV;
+    seq_puts(seqfp, "# TYPE bbswitch_failures counter\n"
+        "# HELP bbswitch_failures Transitions that failed.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (j = 0; j < BBSWITCH_COMMANDS; j++) {
+            if (!metrics_commands[j])
+                continue;
+            spin_lock(&metrics_lock);
+            count = bd->failures[j];
+            spin_unlock(&metrics_lock);
+            seq_printf(seqfp, "bbswitch_failures_total{card=\"%s\",command=\"%s\"} %llu\n",
+                bd->name, metrics_commands[j], count);
         }
     }
 
-    acpi_entry = proc_create("bbswitch", 0664, acpi_root_dir, &bbswitch_fops);
-    if (acpi_entry == NULL) {
-        pr_err("Couldn't create proc entry\n");
-        return -ENOMEM;
+    seq_puts(seqfp, "# TYPE bbswitch_stuck_transitions counter\n"
+        "# HELP bbswitch_stuck_transitions Transitions still running after transition_timeout.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list)
+        seq_printf(seqfp, "bbswitch_stuck_transitions_total{card=\"%s\"} %d\n",
+            bd->name, atomic_read(&bd->stuck_transitions));
+
+    seq_puts(seqfp, "# TYPE bbswitch_mismatches counter\n"
+        "# HELP bbswitch_mismatches State mismatches found by the reconciler.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list)
+        seq_printf(seqfp, "bbswitch_mismatches_total{card=\"%s\"} %d\n",
+            bd->name, atomic_read(&bd->mismatches));
+
+    seq_puts(seqfp, "# TYPE bbswitch_status_reads counter\n"
+        "# HELP bbswitch_status_reads Status reads answered from the cached state or the hardware.\n");
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        for (i = 0; i < 2; i++) {
+            spin_lock(&metrics_lock);
+            count = bd->status_reads[i];
+            spin_unlock(&metrics_lock);
+            seq_printf(seqfp, "bbswitch_status_reads_total{card=\"%s\",source=\"%s\"} %llu\n",
+                bd->name, i ? "hardware" : "cache", count);
+        }
     }
 
-    dis_dev_get();
+aml:
+    seq_puts(seqfp, "# TYPE bbswitch_acpi_method_seconds histogram\n"
+        "# HELP bbswitch_acpi_method_seconds Duration of the ACPI method evaluations.\n"
+        "# UNIT bbswitch_acpi_method_seconds seconds\n");
+    for (i = 0; i <= ARRAY_SIZE(aml_methods); i++) {
+        const char *method = i < ARRAY_SIZE(aml_methods) ?
+            aml_methods[i] : "other";
+
+        spin_lock(&metrics_lock);
+        lat = aml_latency[i];
+        spin_unlock(&metrics_lock);
+
+        cumulative = 0;
+        for (j = 0; j < ARRAY_SIZE(aml_buckets); j++) {
+            cumulative += lat.count[j];
+            seq_printf(seqfp, "bbswitch_acpi_method_seconds_bucket{method=\"%s\",le=\"%s\"} %llu\n",
+                method, aml_buckets[j].le, cumulative);
+        }
+        cumulative += lat.count[j];
+        seq_printf(seqfp, "bbswitch_acpi_method_seconds_bucket{method=\"%s\",le=\"+Inf\"} %llu\n",
+            method, cumulative);
+        seq_printf(seqfp, "bbswitch_acpi_method_seconds_count{method=\"%s\"} %llu\n",
+            method, cumulative);
+        seq_printf(seqfp, "bbswitch_acpi_method_seconds_sum{method=\"%s\"} ", method);
+        metrics_seconds(seqfp, lat.sum_us);
+    }
 
-    if (is_card_disabled() < 1) {
-        /* We think the card is enabled, so ensure the kernel does as well */
-        if (pci_enable_device(dis_dev))
-            pr_warn("failed to enable %s\n", dis_dev_name);
+    seq_puts(seqfp, "# EOF\n");
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(metrics);
+
+static void bbswitch_cleanup(void) {
+    struct bbswitch_dev *bd, *tmp;
+
+    list_for_each_entry_safe(bd, tmp, &bbswitch_devices, list) {
+        bbswitch_unregister_dev(bd);
+        bbswitch_free_dev(bd);
+    }
+}
+
+// Selects the backend of a card and applies load_state. This evaluates AML
+// and may sleep for seconds, so it normally runs asynchronously.
+static int bbswitch_setup_dev(struct bbswitch_dev *bd) {
+    struct pci_dev *bridge;
+    ktime_t start;
+    int stage;
+
+    mutex_lock(&bd->lock);
+    if (bbswitch_select_backend(bd, igd_handle)) {
+        bbswitch_set_state(bd, CARD_UNCHANGED);
+        mutex_unlock(&bd->lock);
+        return -ENODEV;
     }
 
-    if (load_state == CARD_ON){
-        bbswitch_on();
-    } else if (load_state == CARD_OFF){
-        bbswitch_off();
+    start = ktime_get();
+    bridge = dis_dev_get(bd);
+
+    stage = bbswitch_probe_stage(bd);
+    if (stage >= 0)
+        bbswitch_set_stage(bd, stage);
+    if (stage_enumerated(READ_ONCE(bd->stage)) && bd->pdev) {
+        /* We think the card is enabled, so ensure the kernel does as well */
+        if (pci_enable_device(bd->pdev))
+            pr_warn("failed to enable %s\n", bd->name);
+        bbswitch_link_enable_aspm(bd);
     }
+    bbswitch_sync_ready(bd);
+
+    dis_dev_put(bridge);
+    if (load_state != CARD_ON && load_state != CARD_OFF)
+        bbswitch_cache_state(bd);
+    mutex_unlock(&bd->lock);
+    init_phase_end(INIT_PCI_ENABLE, start);
+
+    start = ktime_get();
+    bbswitch_decide_wait(bd, GOV_EV_INIT, load_state, 0);
+    init_phase_end(INIT_LOAD_STATE, start);
 
     pr_info("Succesfully loaded. Discrete card %s is %s\n",
-        dis_dev_name, is_card_disabled() > 0 ? "off" : "on");
+        bd->name, bbswitch_state_name(READ_ONCE(bd->state)));
+    return 0;
+}
 
-    dis_dev_put();
+/*
+ * vga_switcheroo handler for the G14 power resource. Once registered, a DRM
+ * driver with runtime PM asks for the card to be powered off after it has
+ * suspended it and back on before resuming it, without userspace. The driver
+ * stays bound meanwhile, so this bypasses the transition worker, which
+ * refuses to switch a card in use. It must not wait for bd->lock either: the
+ * worker holds it while FORCE-UNBIND makes the driver resume the card. Only
+ * bd->power_lock, which the worker never holds across an unbind, serialises
+ * the two, and the rest is left to bbswitch_switcheroo_work().
+ */
+#if IS_ENABLED(CONFIG_VGA_SWITCHEROO) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+static struct bbswitch_dev *switcheroo_bd;
 
-    register_pm_notifier(&nb);
+static int bbswitch_switcheroo_init(void) {
+    return 0;
+}
 
+// the card is muxless, there is no output to switch
+static int bbswitch_switcheroo_switchto(enum vga_switcheroo_client_id id) {
     return 0;
 }
 
-static void __exit bbswitch_exit(void) {
-    remove_proc_entry("bbswitch", acpi_root_dir);
+static int bbswitch_switcheroo_power_state(enum vga_switcheroo_client_id id,
+    enum vga_switcheroo_state state) {
+    struct bbswitch_dev *bd = switcheroo_bd;
+    int command, target, ret;
+    ktime_t start;
+
+    if (id != VGA_SWITCHEROO_DIS || !bd)
+        return 0;
+
+    target = state == VGA_SWITCHEROO_ON ? CARD_ON : CARD_OFF;
+    command = bbswitch_command(target);
+    start = ktime_get();
+    if (target == CARD_ON) {
+        ret = bbswitch_power_on_once(bd);
+        bbswitch_breaker_update(bd, ret);
+    } else {
+        // the driver has put the card in D3hot already
+        ret = bbswitch_power_off(bd, false);
+    }
+    queue_work(bbswitch_wq, &bd->switcheroo_work);
+
+    journal_add(bd->name, BBSWITCH_CAUSE_SWITCHEROO, 0, NULL, command,
+        bd->backend->name, ret, start, ret ? READ_ONCE(bd->state) : target);
+    metrics_transition(bd, BBSWITCH_CAUSE_SWITCHEROO, command, ret);
+    return ret;
+}
+
+static enum vga_switcheroo_client_id bbswitch_switcheroo_get_client_id(
+    struct pci_dev *pdev) {
+    struct bbswitch_dev *bd = switcheroo_bd;
+    acpi_handle handle = ACPI_HANDLE(&pdev->dev);
+
+    if (handle && handle == igd_handle)
+        return VGA_SWITCHEROO_IGD;
+    if (handle && bd && handle == bd->handle)
+        return VGA_SWITCHEROO_DIS;
+    return VGA_SWITCHEROO_UNKNOWN_ID;
+}
+
+static const struct vga_switcheroo_handler bbswitch_switcheroo_handler = {
+    .init           = bbswitch_switcheroo_init,
+    .switchto       = bbswitch_switcheroo_switchto,
+    .power_state    = bbswitch_switcheroo_power_state,
+    .get_client_id  = bbswitch_switcheroo_get_client_id,
+};
+
+// Registers the handler for the first card using the g14 backend
+static void bbswitch_switcheroo_register(void) {
+    struct bbswitch_dev *bd, *found = NULL;
+
+    if (!switcheroo)
+        return;
+
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        if (bd->backend && !strcmp(bd->backend->name, "g14")) {
+            found = bd;
+            break;
+        }
+    }
+    if (!found) {
+        pr_warn("switcheroo needs a card using the g14 backend\n");
+        return;
+    }
+
+    // callbacks may come as soon as the handler is registered
+    switcheroo_bd = found;
+    if (vga_switcheroo_register_handler(&bbswitch_switcheroo_handler, 0)) {
+        pr_warn("another vga_switcheroo handler is registered\n");
+        switcheroo_bd = NULL;
+        return;
+    }
+    pr_info("registered as vga_switcheroo handler for %s\n", found->name);
+}
+
+static void bbswitch_switcheroo_unregister(void) {
+    if (!switcheroo_bd)
+        return;
+    vga_switcheroo_unregister_handler();
+    switcheroo_bd = NULL;
+}
+#else
+static void bbswitch_switcheroo_register(void) {
+    if (switcheroo)
+        pr_warn("switcheroo needs a kernel with CONFIG_VGA_SWITCHEROO\n");
+}
+
+static void bbswitch_switcheroo_unregister(void) {
+}
+#endif
+
+// Returns the number of cards that can be switched
+static int bbswitch_setup_all(void) {
+    struct bbswitch_dev *bd;
+    int usable = 0;
+
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        if (bbswitch_setup_dev(bd)) {
+            // keep the context for open files, it is freed on unload
+            bbswitch_unregister_dev(bd);
+            continue;
+        }
+        usable++;
+    }
+
+    if (cache_hit)
+        pr_info("used cached _DSM probe results\n");
+    else
+        bbswitch_save_probe_cache(probe_key);
+
+    init_phase_end(INIT_TOTAL, init_start);
+    pr_info("init took %lld us: pci_scan %lld, dsm_probe %lld, register %lld,"
+        " pci_enable %lld, load_state %lld, pm_notifier %lld\n",
+        init_phase_us[INIT_TOTAL], init_phase_us[INIT_PCI_SCAN],
+        init_phase_us[INIT_DSM_PROBE], init_phase_us[INIT_REGISTER],
+        init_phase_us[INIT_PCI_ENABLE], init_phase_us[INIT_LOAD_STATE],
+        init_phase_us[INIT_PM_NOTIFIER]);
+
+    complete_all(&bbswitch_setup_done);
+    bbswitch_switcheroo_register();
+    // the power source policy overrides load_state
+    bbswitch_policy_kick(true);
+    return usable;
+}
+
+static void bbswitch_setup_async(void *data, async_cookie_t cookie) {
+    if (bbswitch_setup_all() == 0)
+        pr_err("No discrete VGA device can be switched\n");
+}
+
+static int __init bbswitch_init(void) {
+    struct bbswitch_dev *bd;
+    struct pci_dev *pdev = NULL;
+    ktime_t start;
+    int index = 0;
+    int ret;
+
+    pr_info("version %s\n", BBSWITCH_VERSION);
+
+    if (journal_size) {
+        journal_size = roundup_pow_of_two(journal_size);
+        journal = kvcalloc(journal_size, sizeof(*journal), GFP_KERNEL);
+        if (journal)
+            journal_mask = journal_size - 1;
+    }
+
+    init_start = ktime_get();
+    probe_key = bbswitch_probe_key();
+    cache_hit = bbswitch_load_probe_cache(probe_key);
+
+    start = ktime_get();
+    if (backend && !strcmp(backend, "sim")) {
+        // the simulated cards replace the hardware
+        while (index < sim_cards) {
+            bd = bbswitch_add_sim_dev(index++);
+            if (bd == NULL) {
+                bbswitch_cleanup();
+                journal_free();
+                return -ENOMEM;
+            }
+            pr_info("Created simulated discrete VGA device %s\n", bd->name);
+        }
+    } else {
+        while ((pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev)) != NULL) {
+            struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+            acpi_handle handle;
+            int pci_class = pdev->class >> 8;
+
+            if (pci_class != PCI_CLASS_DISPLAY_VGA &&
+                pci_class != PCI_CLASS_DISPLAY_3D)
+                continue;
 
-    dis_dev_get();
+            handle = ACPI_HANDLE(&pdev->dev);
 
-    if (unload_state == CARD_ON)
-        bbswitch_on();
-    else if (unload_state == CARD_OFF)
-        bbswitch_off();
+            if (!handle) {
+                pr_warn("cannot find ACPI handle for VGA device %s\n",
+                    dev_name(&pdev->dev));
+                continue;
+            }
+
+            acpi_get_name(handle, ACPI_FULL_PATHNAME, &buf);
+
+            if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
+                igd_handle = handle;
+                pr_info("Found integrated VGA device %s: %s\n",
+                    dev_name(&pdev->dev), (char *)buf.pointer);
+            } else {
+                // nVidia cards are always discrete, others only if they have the
+                // Optimus _DSM
+                if(pdev->vendor == PCI_VENDOR_ID_NVIDIA ||
+                    handle_has_dsm_func(handle,acpi_optimus_dsm_muid, 0x100, 0x1A)){
+                    bd = bbswitch_add_dev(pdev, handle);
+                    if (bd == NULL) {
+                        kfree(buf.pointer);
+                        pci_dev_put(pdev);
+                        bbswitch_cleanup();
+                        journal_free();
+                        return -ENOMEM;
+                    }
+                    bd->index = index++;
+                    pr_info("Found discrete VGA device %s: %s\n",
+                        dev_name(&pdev->dev), (char *)buf.pointer);
+                }else{
+                    igd_handle = handle;
+                    pr_info("Found non-intel integrated VGA device %s: %s\n",
+                        dev_name(&pdev->dev), (char *)buf.pointer);
+                }
+            }
+            kfree(buf.pointer);
+        }
+    }
+    init_phase_end(INIT_PCI_SCAN, start);
+
+    if (list_empty(&bbswitch_devices)) {
+        pr_err("No discrete VGA device found\n");
+        journal_free();
+        return -ENODEV;
+    }
+
+    bbswitch_wq = alloc_workqueue("bbswitch", WQ_UNBOUND, 0);
+    if (!bbswitch_wq) {
+        bbswitch_cleanup();
+        journal_free();
+        return -ENOMEM;
+    }
 
-    pr_info("Unloaded. Discrete card %s is %s\n",
-        dis_dev_name, is_card_disabled() > 0 ? "off" : "on");
+    bbswitch_debugfs = debugfs_create_dir("bbswitch", NULL);
+    debugfs_create_file("init_timings", 0444, bbswitch_debugfs, NULL,
+        &init_timings_fops);
+    debugfs_create_file("on_latency", 0444, bbswitch_debugfs, NULL,
+        &on_latency_fops);
+    debugfs_create_file("journal", 0444, bbswitch_debugfs, NULL,
+        &journal_fops);
+    debugfs_create_file("journal.bin", 0400, bbswitch_debugfs, NULL,
+        &journal_bin_fops);
+    debugfs_create_file("metrics", 0444, bbswitch_debugfs, NULL,
+        &metrics_fops);
+    bbswitch_faults_init(bbswitch_debugfs);
+
+    // the nodes report TRANSITIONING until the initial state is applied
+    start = ktime_get();
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        ret = bbswitch_register_dev(bd);
+        if (ret) {
+            bbswitch_cleanup();
+            debugfs_remove_recursive(bbswitch_debugfs);
+            destroy_workqueue(bbswitch_wq);
+            journal_free();
+            return ret;
+        }
+    }
+    init_phase_end(INIT_REGISTER, start);
+
+    start = ktime_get();
+    register_pm_notifier(&nb);
+    power_supply_reg_notifier(&psy_nb);
+    bus_register_notifier(&pci_bus_type, &bus_nb);
+    kernel_param_lock(THIS_MODULE);
+    reconcile_enabled = true;
+    bbswitch_reconcile_schedule();
+    kernel_param_unlock(THIS_MODULE);
+    init_phase_end(INIT_PM_NOTIFIER, start);
+
+    if (async_init) {
+        async_schedule_domain(bbswitch_setup_async, NULL,
+            &bbswitch_async_domain);
+    } else if (bbswitch_setup_all() == 0) {
+        unregister_pm_notifier(&nb);
+        power_supply_unreg_notifier(&psy_nb);
+        bus_unregister_notifier(&pci_bus_type, &bus_nb);
+        bbswitch_reconcile_stop();
+        cancel_work_sync(&policy_eval_work);
+        cancel_delayed_work_sync(&policy_apply_work);
+        bbswitch_cleanup();
+        debugfs_remove_recursive(bbswitch_debugfs);
+        destroy_workqueue(bbswitch_wq);
+        journal_free();
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+static void __exit bbswitch_exit(void) {
+    struct bbswitch_dev *bd, *tmp;
 
-    dis_dev_put();
+    WRITE_ONCE(bbswitch_exiting, true);
+    async_synchronize_full_domain(&bbswitch_async_domain);
+    bbswitch_switcheroo_unregister();
+    debugfs_remove_recursive(bbswitch_debugfs);
 
     if (nb.notifier_call)
         unregister_pm_notifier(&nb);
+    power_supply_unreg_notifier(&psy_nb);
+    bus_unregister_notifier(&pci_bus_type, &bus_nb);
+    bbswitch_reconcile_stop();
+
+    // no governor change while the cards go away
+    mutex_lock(&governor_lock);
+    list_for_each_entry(bd, &bbswitch_devices, list) {
+        bbswitch_unregister_dev(bd);
+        if (!bd->backend)
+            continue;
+
+        cancel_work_sync(&bd->bind_work);
+        // the timer must not turn the card off behind unload_state
+        cancel_delayed_work_sync(&bd->gov_work);
+        bbswitch_decide_wait(bd, GOV_EV_EXIT, unload_state, 0);
+        // the context cannot go away while a stuck transition uses it
+        flush_work(&bd->transition_work);
+
+        pr_info("Unloaded. Discrete card %s is %s\n",
+            bd->name, bbswitch_state_name(READ_ONCE(bd->state)));
+    }
+    // transitions that ended before bbswitch_exiting was seen may have
+    // kicked the policy
+    cancel_work_sync(&policy_eval_work);
+    cancel_delayed_work_sync(&policy_apply_work);
+    list_for_each_entry_safe(bd, tmp, &bbswitch_devices, list)
+        bbswitch_free_dev(bd);
+    mutex_unlock(&governor_lock);
+    destroy_workqueue(bbswitch_wq);
+    journal_free();
 }
 
 module_init(bbswitch_init);
@@ -0,0 +1,117 @@
+/*
+ * Userspace interface of /dev/bbswitch
+ *
+ *  Copyright (C) 2011-2013 Bumblebee Project
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+#ifndef BBSWITCH_H
+#define BBSWITCH_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define BBSWITCH_IOC_MAGIC 'B'
+
+/* Keep the card powered until this file descriptor is released or closed.
+ * When the last hold is dropped, the card is turned off again. */
+#define BBSWITCH_IOC_HOLD       _IO(BBSWITCH_IOC_MAGIC, 1)
+/* Drop the hold taken by BBSWITCH_IOC_HOLD on this file descriptor */
+#define BBSWITCH_IOC_RELEASE    _IO(BBSWITCH_IOC_MAGIC, 2)
+
+/* Card states, as reported in /proc/acpi/bbswitch */
+#define BBSWITCH_STATE_UNKNOWN          -1
+#define BBSWITCH_STATE_OFF              0
+#define BBSWITCH_STATE_ON               1
+#define BBSWITCH_STATE_TRANSITIONING    2
+#define BBSWITCH_STATE_TIMEOUT          3
+#define BBSWITCH_STATE_STANDBY          4
+/* ON with a driver bound, only reported when the autobind option is set */
+#define BBSWITCH_STATE_READY            5
+
+/* Where the card is in a transition, with the stages of power on in order */
+enum bbswitch_stage {
+    BBSWITCH_STAGE_OFF = 0,
+    BBSWITCH_STAGE_POWERING_ON = 1,     /* powered, the link is down */
+    BBSWITCH_STAGE_LINK_UP = 2,         /* the link is up, not on the bus yet */
+    BBSWITCH_STAGE_ENUMERATED = 3,      /* on the bus without a driver */
+    BBSWITCH_STAGE_DRIVER_BOUND = 4,
+    BBSWITCH_STAGE_POWERING_OFF = 5,
+    BBSWITCH_STAGE_ERROR = 6,           /* the last transition failed */
+};
+
+/* Everything known about a card, read without touching the hardware */
+struct bbswitch_status {
+    char name[16];                  /* PCI address of the card */
+    char backend[16];               /* empty if the card can't be switched */
+    __s32 state;                    /* BBSWITCH_STATE_* */
+    __u32 hold_count;
+    __u32 on_failures;              /* consecutive failed power ons */
+    __u32 breaker_open;             /* ON requests fail until RESET */
+    __u32 stuck_transitions;
+    __u32 on_latency_us;
+    __u32 changes;                  /* number of state changes so far */
+    __u32 stage;                    /* BBSWITCH_STAGE_* */
+};
+
+/* Fills a struct bbswitch_status. poll() on the file descriptor reports
+ * POLLIN once the state has changed since the last BBSWITCH_IOC_STATUS. */
+#define BBSWITCH_IOC_STATUS     _IOR(BBSWITCH_IOC_MAGIC, 3, struct bbswitch_status)
+
+/* Return as soon as the request is queued */
+#define BBSWITCH_SET_NOWAIT             (1 << 0)
+/* With BBSWITCH_STATE_OFF: unbind the drivers of all functions of the card
+ * first unless one of them is in use, like writing OFF FORCE-UNBIND */
+#define BBSWITCH_SET_FORCE_UNBIND       (1 << 1)
+
+struct bbswitch_set {
+    __s32 state;                    /* BBSWITCH_STATE_OFF, _ON or _STANDBY */
+    __u32 flags;                    /* BBSWITCH_SET_* */
+    __u32 timeout_ms;               /* 0 for the transition_timeout parameter */
+    __u32 reserved;
+};
+
+/* Switches the card like writing ON, OFF or STANDBY to /proc/acpi/bbswitch.
+ * Fails with ETIMEDOUT if the card is still switching after the timeout. */
+#define BBSWITCH_IOC_SET        _IOW(BBSWITCH_IOC_MAGIC, 4, struct bbswitch_set)
+
+/* Records of /sys/kernel/debug/bbswitch/journal.bin, oldest first */
+enum bbswitch_journal_command {
+    BBSWITCH_JOURNAL_OFF = 0,
+    BBSWITCH_JOURNAL_ON = 1,
+    BBSWITCH_JOURNAL_AML = 2,       /* method holds the evaluated method */
+    BBSWITCH_JOURNAL_STANDBY = 3,
+};
+
+enum bbswitch_journal_cause {
+    BBSWITCH_CAUSE_USER = 0,        /* pid and comm are the requester */
+    BBSWITCH_CAUSE_HOLD = 1,        /* hold taken or released */
+    BBSWITCH_CAUSE_PM = 2,          /* suspend or resume */
+    BBSWITCH_CAUSE_INIT = 3,        /* load_state */
+    BBSWITCH_CAUSE_EXIT = 4,        /* unload_state */
+    BBSWITCH_CAUSE_AML = 5,         /* AML evaluation during a transition */
+    BBSWITCH_CAUSE_POLICY = 6,      /* power source change */
+    BBSWITCH_CAUSE_GOVERNOR = 7,    /* driver binding or governor timer */
+    BBSWITCH_CAUSE_RECONCILE = 8,   /* repair of a state mismatch */
+    BBSWITCH_CAUSE_SWITCHEROO = 9,  /* runtime PM of the DRM driver */
+};
+
+struct bbswitch_journal_entry {
+    __u64 seq;
+    __u64 timestamp_ns;             /* CLOCK_BOOTTIME at the start */
+    __u32 duration_us;
+    __s32 status;                   /* 0, -errno or the ACPI status */
+    __s32 pid;
+    __u8 cause;
+    __u8 command;
+    __s8 state;                     /* card state afterwards, -1 if unknown */
+    __u8 reserved;
+    char comm[16];
+    char method[16];                /* backend or ACPI method name */
+    char device[16];                /* PCI address of the card */
+};
+
+#endif /* BBSWITCH_H */
@@ -0,0 +1,302 @@
+/*
+ * bbswitchctl - control the discrete graphics card through /dev/bbswitch
+ *
+ *  Copyright (C) 2011-2013 Bumblebee Project
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ * Usage:
+ *  bbswitchctl [-d DEVICE] status [--json]
+ *  bbswitchctl [-d DEVICE] on|off|standby [--wait] [--timeout MS]
+ *  bbswitchctl [-d DEVICE] off --force-unbind [--wait] [--timeout MS]
+ *  bbswitchctl [-d DEVICE] watch [--json]
+ *
+ * Without -d, status and watch cover every card (/dev/bbswitch,
+ * /dev/bbswitch1, ...) and on, off and standby the first one.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "bbswitch.h"
+
+#define MAX_CARDS 8
+
+struct card {
+    const char *path;
+    char path_buf[32];
+    int fd;
+};
+
+static struct card cards[MAX_CARDS];
+static int ncards;
+
+static void usage(FILE *fp) {
+    fprintf(fp,
+        "Usage: bbswitchctl [-d DEVICE] status [--json]\n"
+        "       bbswitchctl [-d DEVICE] on|off|standby [--wait] [--timeout MS]\n"
+        "       bbswitchctl [-d DEVICE] off --force-unbind [--wait] [--timeout MS]\n"
+        "       bbswitchctl [-d DEVICE] watch [--json]\n");
+}
+
+static const char *state_name(int state) {
+    switch (state) {
+    case BBSWITCH_STATE_OFF:
+        return "OFF";
+    case BBSWITCH_STATE_ON:
+        return "ON";
+    case BBSWITCH_STATE_TRANSITIONING:
+        return "TRANSITIONING";
+    case BBSWITCH_STATE_TIMEOUT:
+        return "TIMEOUT";
+    case BBSWITCH_STATE_STANDBY:
+        return "STANDBY";
+    case BBSWITCH_STATE_READY:
+        return "READY";
+    }
+    return "UNKNOWN";
+}
+
+static const char *stage_name(unsigned int stage) {
+    static const char * const names[] = {
+        [BBSWITCH_STAGE_OFF]            = "OFF",
+        [BBSWITCH_STAGE_POWERING_ON]    = "POWERING_ON",
+        [BBSWITCH_STAGE_LINK_UP]        = "LINK_UP",
+        [BBSWITCH_STAGE_ENUMERATED]     = "ENUMERATED",
+        [BBSWITCH_STAGE_DRIVER_BOUND]   = "DRIVER_BOUND",
+        [BBSWITCH_STAGE_POWERING_OFF]   = "POWERING_OFF",
+        [BBSWITCH_STAGE_ERROR]          = "ERROR",
+    };
+
+    if (stage >= sizeof(names) / sizeof(names[0]))
+        return "UNKNOWN";
+    return names[stage];
+}
+
+static int open_card(struct card *c) {
+    c->fd = open(c->path, O_RDONLY | O_CLOEXEC);
+    if (c->fd < 0)
+        return -errno;
+    return 0;
+}
+
+// Opens the given device, or all cards if device is NULL. Returns 0 on
+// success.
+static int open_cards(const char *device, int max) {
+    int ret;
+
+    if (device) {
+        cards[0].path = device;
+        ret = open_card(&cards[0]);
+        if (ret) {
+            fprintf(stderr, "bbswitchctl: %s: %s\n", device, strerror(-ret));
+            return 1;
+        }
+        ncards = 1;
+        return 0;
+    }
+
+    for (ncards = 0; ncards < max; ncards++) {
+        struct card *c = &cards[ncards];
+
+        if (ncards == 0)
+            snprintf(c->path_buf, sizeof(c->path_buf), "/dev/bbswitch");
+        else
+            snprintf(c->path_buf, sizeof(c->path_buf), "/dev/bbswitch%d",
+                ncards);
+        c->path = c->path_buf;
+        ret = open_card(c);
+        if (ret == -ENOENT)
+            break;
+        if (ret) {
+            fprintf(stderr, "bbswitchctl: %s: %s\n", c->path, strerror(-ret));
+            return 1;
+        }
+    }
+
+    if (ncards == 0) {
+        fprintf(stderr, "bbswitchctl: /dev/bbswitch not found, is the module"
+            " loaded?\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void print_status(const struct bbswitch_status *st, int json) {
+    if (!json) {
+        // how far the transition got
+        if (st->state == BBSWITCH_STATE_TRANSITIONING ||
+            st->state == BBSWITCH_STATE_TIMEOUT)
+            printf("%s %s %s\n", st->name, state_name(st->state),
+                stage_name(st->stage));
+        else
+            printf("%s %s\n", st->name, state_name(st->state));
+        return;
+    }
+    printf("{\"device\":\"%s\",\"state\":\"%s\",\"stage\":\"%s\","
+        "\"backend\":\"%s\",\"holds\":%u,\"on_failures\":%u,"
+        "\"breaker_open\":%s,\"stuck_transitions\":%u,\"on_latency_us\":%u,"
+        "\"changes\":%u}",
+        st->name, state_name(st->state), stage_name(st->stage), st->backend,
+        st->hold_count, st->on_failures, st->breaker_open ? "true" : "false",
+        st->stuck_transitions, st->on_latency_us, st->changes);
+}
+
+static int get_status(struct card *c, struct bbswitch_status *st) {
+    if (ioctl(c->fd, BBSWITCH_IOC_STATUS, st)) {
+        fprintf(stderr, "bbswitchctl: %s: %s\n", c->path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_status(int json) {
+    struct bbswitch_status st;
+    int i;
+
+    if (json)
+        printf("[");
+    for (i = 0; i < ncards; i++) {
+        if (get_status(&cards[i], &st))
+            return 1;
+        if (json && i)
+            printf(",");
+        print_status(&st, json);
+    }
+    if (json)
+        printf("]\n");
+    return 0;
+}
+
+static int cmd_set(int state, unsigned int flags, int wait,
+    unsigned int timeout_ms) {
+    struct bbswitch_set set = {
+        .state = state,
+        .flags = flags | (wait ? 0 : BBSWITCH_SET_NOWAIT),
+        .timeout_ms = timeout_ms,
+    };
+
+    if (ioctl(cards[0].fd, BBSWITCH_IOC_SET, &set)) {
+        if (errno == ETIMEDOUT)
+            fprintf(stderr, "bbswitchctl: %s: still switching after the"
+                " timeout\n", cards[0].path);
+        else
+            fprintf(stderr, "bbswitchctl: %s: %s\n", cards[0].path,
+                strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Prints the state of every card once and then whenever it changes
+static int cmd_watch(int json) {
+    struct pollfd pfd[MAX_CARDS];
+    struct bbswitch_status st;
+    int i;
+
+    for (i = 0; i < ncards; i++) {
+        pfd[i].fd = cards[i].fd;
+        pfd[i].events = POLLIN;
+        if (get_status(&cards[i], &st))
+            return 1;
+        print_status(&st, json);
+        if (json)
+            printf("\n");
+    }
+    fflush(stdout);
+
+    for (;;) {
+        if (poll(pfd, ncards, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("bbswitchctl: poll");
+            return 1;
+        }
+        for (i = 0; i < ncards; i++) {
+            if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                return 1;
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            if (get_status(&cards[i], &st))
+                return 1;
+            print_status(&st, json);
+            if (json)
+                printf("\n");
+        }
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *device = NULL;
+    unsigned int timeout_ms = 0, flags = 0;
+    int json = 0, wait = 0;
+    const char *cmd;
+    char *end;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            device = argv[++i];
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage(stdout);
+            return 0;
+        } else {
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (i >= argc) {
+        usage(stderr);
+        return 2;
+    }
+    cmd = argv[i++];
+
+    for (; i < argc; i++) {
+        if (!strcmp(argv[i], "--json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "--wait")) {
+            wait = 1;
+        } else if (!strcmp(argv[i], "--force-unbind") && !strcmp(cmd, "off")) {
+            flags |= BBSWITCH_SET_FORCE_UNBIND;
+        } else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+            timeout_ms = strtoul(argv[++i], &end, 10);
+            if (*end || timeout_ms == 0) {
+                fprintf(stderr, "bbswitchctl: invalid timeout '%s'\n", argv[i]);
+                return 2;
+            }
+            wait = 1;
+        } else {
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if (!strcmp(cmd, "status")) {
+        if (open_cards(device, MAX_CARDS))
+            return 1;
+        return cmd_status(json);
+    } else if (!strcmp(cmd, "on") || !strcmp(cmd, "off") ||
+        !strcmp(cmd, "standby")) {
+        if (open_cards(device, 1))
+            return 1;
+        return cmd_set(!strcmp(cmd, "on") ? BBSWITCH_STATE_ON :
+            !strcmp(cmd, "off") ? BBSWITCH_STATE_OFF : BBSWITCH_STATE_STANDBY,
+            flags, wait, timeout_ms);
+    } else if (!strcmp(cmd, "watch")) {
+        if (open_cards(device, MAX_CARDS))
+            return 1;
+        return cmd_watch(json);
+    }
+
+    usage(stderr);
+    return 2;
+}